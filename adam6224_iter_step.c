@@ -6,28 +6,102 @@
  *
  * Особенности:
  * - все 8 каналов измеряются последовательно после settle-задержки;
+ *   aiN_settle_ms задаёт каналу своё смещение от t_set — шаг читает AI
+ *   по отсортированному расписанию, каналы с общим смещением — одним
+ *   пакетным чтением, момент отсчёта каждого канала пишется в CSV;
+ * - режим АЦП ADAM-6717 (ai_integration_mode, ai_filter_*) задаётся
+ *   параметрами; iter_ai_tune подбирает самый быстрый режим с шумом
+ *   не выше заданного и записывает его в iter_params.txt;
  * - при ошибке чтения берётся предыдущее успешное значение;
- * - code_read удалён, AO считывается только по рассчитанному code_set;
+ * - code_read удалён, ao_V считается по рассчитанному code_set; проверка
+ *   регистра AO чтением — раз в ao_verify_every шагов и/или при запасе
+ *   времени до следующего шага (ao_verify_slack_us), расхождения — в лог;
  * - ao_V сохраняется в CSV;
- * - stdout оставлен для отладки (8 каналов одной строкой);
+ * - stdout оставлен для отладки (8 каналов одной строкой, см. console);
  * - период шага выдерживается строго через CLOCK_MONOTONIC + ABSOLUTE sleep;
+ * - последовательность кодов AO каждой фазы рассчитывается до t0;
+ *   фаза может проигрывать внешнюю волновую форму (wave_file) через mmap
+ *   или встроенный генератор профиля (profile=triangle/sine/staircase/prbs);
+ * - control_mode=pid: профиль задаёт уставку, AO0 рассчитывается
+ *   ПИД-регулятором по выбранному AI-каналу с фиксированным шагом;
+ * - калибровка (calib_file): AO — таблица кодов на 4096 значений,
+ *   AI — усиление/смещение одним проходом по 8 каналам;
+ * - несколько модулей AO (devN_ip): запись шага рассылается всем модулям
+ *   параллельно, латентность и перекос фиксируются на каждом шаге;
+ * - удалённые модули AI (raiN_ip) опрашиваются Modbus/TCP одновременно
+ *   с чтением встроенных AI и добавляются в ту же строку CSV;
+ * - моменты шага хранятся целыми нс CLOCK_MONOTONIC, привязка
+ *   к CLOCK_REALTIME пишется в лог в начале и периодически (#anchor);
+ * - checkpoint=1: на границах фаз сохраняется контрольная точка,
+ *   запуск с --resume продолжает прогон в тот же CSV;
+ * - watchdog=1: сторожевой таймер ADAM-6717 (SetWDTTimeout) кормится из цикла
+ *   только при соблюдении дедлайнов; отдельный процесс-сторож выставляет
+ *   безопасный код AO при остановке цикла или гибели процесса, основной
+ *   процесс — при аварийном прерывании прогона по ошибке записи AO;
+ * - trig_di: старт прогона или каждого цикла по фронту DI ADAM-6717,
+ *   sync_do: DO переключается на каждом шаге AO (синхронизация с осциллографом);
+ * - aggregate=1: статистика по каждой точке (фаза, шаг) за все циклы
+ *   (среднее, СКО, min, max) в статической таблице, периодический сброс
+ *   усреднённой кривой в iter_avg_*.csv; agg_raw=0 отключает сырые строки;
+ * - прореживание лога: каждая N-я строка (log_every) и/или зона
+ *   нечувствительности по каналам (aiN_deadband_mV), первая и последняя
+ *   строки фазы пишутся всегда, число пропущенных — в столбце skipped;
+ * - lock-in (stepN_lockin_periods): синус из таблицы кодов на той же сетке
+ *   шагов, I/Q по таблицам sin/cos для всех 8 каналов одним проходом,
+ *   амплитуда и фаза каждого блока — в iter_lockin_*.csv;
+ * - log_format=packed: сжатый лог iter_8ch_*.bin (квантованные AI,
+ *   разности в zig-zag varint, независимые блоки), iter_log_unpack
+ *   на ПК восстанавливает стандартный CSV;
+ * - --daemon: аппаратура открывается один раз, прогоны берутся из
+ *   каталога очереди (daemon_spool) и выполняются подряд с гарантированной
+ *   паузой между ними;
+ * - trace=1: бортовой самописец — кольцо событий цикла (пробуждение,
+ *   запись AO, чтение AI, запись лога, опоздания, ошибки связи) с метками нс,
+ *   выгрузка по SIGUSR1, при опоздании шага и в конце прогона;
+ * - metrics_port: счётчики, показатели и гистограммы задержек для
+ *   Prometheus; цикл обновляет их в общей памяти без блокировок,
+ *   HTTP отдаёт отдельный процесс;
+ * - console=summary|step|off: строка состояния в stdout раз в
+ *   console_rate_ms или на каждом шаге, без блокировки — при занятом
+ *   stdout строка отбрасывается и учитывается;
+ * - log_stage_dir: лог пишется в ОЗУ (tmpfs), фоновый процесс с низким
+ *   приоритетом переносит его на носитель кусками с fsync по политике
+ *   log_fsync; объём в ОЗУ ограничен log_stage_max_kb.
  */
 
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64    /* лог и смещения контрольной точки > 2 ГБ на armhf */
 #include <stdio.h>
+#include <stdio_ext.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
 #include <modbus/modbus.h>
 
 #include "adamapi.h"
 
 #define ITER_PARAMS_FILE   "/home/root/iter_params.txt"
+#define ITER_SPOOL_DIR     "/home/root/iter_spool"
+#define ITER_CHECKPOINT_FILE "/home/root/iter_checkpoint.txt"
 
 #define ADAM6224_IP      "192.168.2.2"
 #define ADAM6224_PORT    502
@@ -35,12 +109,94 @@
 
 #define AO0_REG_ADDR     0
 
+#define MAX_AO_DEVICES   8
+#define DEV_IP_LEN       32
+/* Предельное ожидание ответов на параллельную запись, мс */
+#define DEV_RESPONSE_TIMEOUT_MS 500
+
+#define MAX_REMOTE_AI    4
+#define REMOTE_AI_MAX_CH 8
+
+/* Дискретные каналы ADAM-6717 (DIO_GetValues / DO_SetValue) */
+#define IO_DI_TOTAL      5
+#define IO_DO_TOTAL      2
+
 #define AO_MIN_V   (-5.0)
 #define AO_MAX_V   ( 5.0)
 
+#define AO_CODE_MAX      4095
+#define AO_CODES         (AO_CODE_MAX + 1)
+/* Шаг ЦАП, предрасчитанный как константа: в цикле только умножение */
+#define AO_CODES_PER_V   ((double)AO_CODE_MAX / (AO_MAX_V - AO_MIN_V))
+#define AO_V_PER_CODE    ((AO_MAX_V - AO_MIN_V) / (double)AO_CODE_MAX)
+
+/* Калибровка: число AO-выходов с собственной таблицей и точек кусочно-линейной */
+#define AO_CAL_CHANNELS  MAX_AO_DEVICES
+#define CAL_MAX_POINTS   32
+#define CALIB_PATH_LEN   128
+
 
 #define MAX_PHASES 4
 
+/* Минимальный запас между чтением AI и концом шага */
+#define SETTLE_MARGIN_US 1000L
+
+/* Общий пул предрасчитанных шагов для линейных фаз */
+#define MAX_SEQ_STEPS    65536
+/* Точек (фаза, шаг) для усреднения по циклам — как пул шагов; неиспользуемая
+   часть таблицы (bss) в ОЗУ не попадает */
+#define MAX_AGG_POINTS   MAX_SEQ_STEPS
+
+/* Сжатый лог (log_format=packed) */
+#define PK_MAGIC          "ITERPK1\n"
+#define PK_VERSION        1
+#define PK_MAX_BLOCK_ROWS 4096
+/* худшая строка pk_row: тег; cycle/phase/idx, шаг сетки и 4 момента в нс —
+   varint до 10 байт; iter_mV, code_set и 8 AI — разности int32, до 5 байт */
+#define PK_ROW_MAX        (1 + 8 * 10 + 10 * 5)
+#define PK_TEXT_MAX       256
+#define PK_BUF_SIZE       (PK_MAX_BLOCK_ROWS * PK_ROW_MAX)
+#define PK_TAG_POS        0x01     /* явные cycle/phase/idx */
+#define PK_TAG_GRID       0x02     /* новый шаг сетки, нс */
+#define PK_TAG_TEXT       0x80     /* строка '#' целиком */
+#define PK_AI_RANGE_V     100.0    /* |AI| после калибровки, который помещается в int32 */
+
+/* Бортовой самописец (trace=1) */
+#define TRACE_MAGIC       "ITERTRC1"
+#define TRACE_VERSION     1
+#define TRACE_MIN_EVENTS  1024
+#define TRACE_MAX_EVENTS  65536    /* степень двойки, 16 байт на событие */
+
+#define WAVE_PATH_LEN    128
+#define WAVE_CACHE_EXT   ".codes"
+#define WAVE_CACHE_MAGIC "ITERWAV1"
+/* Окно упреждающей подгрузки волновой формы, шагов (64 КиБ кодов) */
+#define WAVE_READAHEAD_STEPS 32768
+
+/* Таблица синуса Q15 на полный оборот для генератора profile=sine */
+#define SINE_TABLE_BITS  10
+#define SINE_TABLE_SIZE  (1 << SINE_TABLE_BITS)
+
+#define PRBS_MIN_ORDER   2
+#define PRBS_MAX_ORDER   15
+
+typedef enum {
+    PROFILE_LINEAR = 0,
+    PROFILE_TRIANGLE,
+    PROFILE_SINE,
+    PROFILE_STAIRCASE,
+    PROFILE_PRBS
+} ProfileType;
+
+/* Политика fsync лога при промежуточном хранении в ОЗУ (log_fsync=...) */
+enum { LOG_FSYNC_NONE = 0, LOG_FSYNC_END = 1, LOG_FSYNC_CHUNK = 2 };
+
+/* Вывод состояния в консоль (console=...) */
+enum { CONSOLE_OFF = 0, CONSOLE_SUMMARY = 1, CONSOLE_STEP = 2 };
+
+/* Результат проверки AO чтением регистра (столбец ao_verify) */
+enum { AO_VERIFY_SKIP = -1, AO_VERIFY_OK = 0, AO_VERIFY_MISMATCH = 1, AO_VERIFY_ERROR = 2 };
+
 typedef struct {
     int start_mV;
     int end_mV;
@@ -48,27 +204,282 @@ typedef struct {
     int period_ms;
     int settle_ms;
     int pause_ms;
+    long period_us;     /* фактический период шага; 0 — из period_ms */
+    long settle_us;     /* фактическая задержка измерения; 0 — из settle_ms */
+    char wave_file[WAVE_PATH_LEN];  /* пусто — линейный профиль */
+    ProfileType profile;
+    long periods;       /* число повторов периода генератора */
+    int amp_mV;         /* sine: амплитуда */
+    int offset_mV;      /* sine: центр */
+    double freq_Hz;     /* sine: частота */
+    int dwell_ms;       /* staircase/prbs: длительность ступени/бита */
+    int prbs_order;     /* prbs: порядок LFSR, период 2^n-1 */
+    unsigned seed;      /* prbs: начальное состояние LFSR */
+    long lockin_periods;  /* sine: >0 — синхронное детектирование, блок из N периодов */
 } IterPhase;
 
+/* Конечная точка Modbus/TCP модуля AO; калибровка — таблица aoN */
+typedef struct {
+    char ip[DEV_IP_LEN];
+    int port;
+    int slave;
+    int reg;
+} AoDeviceCfg;
+
+/* Удалённый модуль AI: count входных регистров с reg, значение = gain*raw + offset */
+typedef struct {
+    char ip[DEV_IP_LEN];
+    int port;
+    int slave;
+    int reg;
+    int count;
+    int is_signed;
+    double gain;
+    double offset;
+} RemoteAiCfg;
+
 typedef struct {
     IterPhase phases[MAX_PHASES];
     int num_phases;
     long repeats;
+
+    /* Адаптивное ожидание settle (settle_mode=adaptive) */
+    int settle_adaptive;
+    unsigned settle_mask;   /* каналы AI, по которым определяется установление */
+    int settle_count;       /* K подряд отсчётов внутри полосы */
+    double settle_tol_V;    /* полуширина полосы допуска */
+    long settle_poll_us;    /* интервал опроса; 0 — подряд */
+    int settle_early;       /* разрешить ранний старт следующего шага */
+    long min_period_us;     /* нижняя граница периода при раннем старте */
+
+    /* Режим АЦП ADAM-6717 (подбирается iter_ai_tune) */
+    int ai_integration_mode;  /* AI_SetIntegrationMode: 0x00 / 0x80 / 0xA0 */
+    unsigned ai_filter_mask;  /* AI_SetAutoFilterEnabled: каналы с фильтром */
+    int ai_filter_percent;    /* уровень фильтра, 1..9 (x10 % FSR) */
+
+    /* Смещения измерения каналов (aiN_settle_ms) */
+    long ai_settle_us[8];   /* от t_set; <0 — settle фазы */
+    int ai_stagger;         /* задано хотя бы одно смещение */
+
+    /* Замкнутый контур (control_mode=pid) */
+    int pid_enabled;
+    int pid_channel;        /* AI-канал обратной связи */
+    double pid_kp;          /* В/В */
+    double pid_ki;          /* 1/с */
+    double pid_kd;          /* с */
+    double pid_out_min_V;
+    double pid_out_max_V;
+
+    char calib_file[CALIB_PATH_LEN];  /* пусто — идеальное преобразование */
+
+    /* Модули AO; dev0 по умолчанию — ADAM6224_IP/PORT/SLAVE */
+    AoDeviceCfg devices[MAX_AO_DEVICES];
+    int num_devices;
+
+    /* Проверка AO чтением регистра; 0 — выключено */
+    long ao_verify_every;     /* каждый N-й шаг */
+    long ao_verify_slack_us;  /* или при запасе до следующего шага не меньше */
+
+    /* Удалённые модули AI (raiN_ip) */
+    RemoteAiCfg rai[MAX_REMOTE_AI];
+    int num_rai;
+    long rai_margin_us;       /* сбор ответов заканчивается за столько до конца шага */
+
+    long anchor_interval_s;   /* период повторной привязки часов; 0 — только в начале */
+
+    int checkpoint_enabled;   /* контрольные точки на границах фаз */
+
+    /* Сторожевой таймер (watchdog=1) */
+    int wdt_enabled;
+    long wdt_timeout_ms;      /* простой цикла, после которого AO -> безопасный код */
+    long wdt_late_us;         /* шаг считается «в срок», если опоздание не больше */
+    int wdt_safe_code;        /* безопасный код AO (пишется как есть) */
+    int wdt_module_timeout;   /* SetWDTTimeout модуля; 0 — не взводить */
+    long wdt_feed_ms;         /* период подкормки таймера модуля */
+
+    /* Аппаратная синхронизация */
+    int trig_di;              /* DI запуска, -1 — без триггера */
+    int trig_falling;         /* 0 — передний фронт, 1 — задний */
+    int trig_each_cycle;      /* 0 — ждать один раз, 1 — перед каждым циклом */
+    long trig_poll_us;        /* период опроса DI; 0 — непрерывно */
+    int sync_do;              /* DO, переключаемый на каждом шаге, -1 — нет */
+
+    /* Усреднение по циклам */
+    int aggregate;
+    long agg_dump_cycles;     /* сброс усреднённой кривой каждые N циклов, 0 — в конце */
+    int agg_raw;              /* писать ли сырые строки в основной CSV */
+
+    /* Прореживание лога */
+    long log_every;           /* писать каждую N-ю строку */
+    float deadband_V[8];      /* зона нечувствительности канала, <0 — не проверять */
+    int deadband_enabled;
+    long log_max_skip;        /* не больше N пропусков подряд, 0 — без ограничения */
+
+    /* Сжатый лог */
+    int log_packed;           /* log_format=packed */
+    long log_quant_nV;        /* шаг квантования AI, нВ */
+    long log_block_rows;      /* строк в независимом блоке */
+
+    /* Лог в ОЗУ (tmpfs) с фоновым переносом на носитель */
+    char log_stage_dir[CALIB_PATH_LEN];   /* пусто — запись прямо в лог */
+    long log_chunk_kb;        /* перенос целыми кусками */
+    long log_stage_max_kb;    /* не больше в ОЗУ, иначе цикл ждёт переноса */
+    int log_fsync;            /* LOG_FSYNC_* */
+
+    /* Режим демона (--daemon) */
+    char daemon_spool[CALIB_PATH_LEN];  /* каталог очереди заданий */
+    long daemon_gap_ms;       /* минимальная пауза между прогонами */
+    long daemon_poll_ms;      /* период опроса пустой очереди */
+
+    /* Бортовой самописец (trace=1) */
+    int trace_enabled;
+    long trace_events;        /* размер кольца, степень двойки */
+    long trace_late_us;       /* автовыгрузка при опоздании шага больше; 0 — нет */
+    long trace_dump_max;      /* не больше N автовыгрузок за прогон */
+
+    /* Вывод в консоль */
+    int console_mode;         /* CONSOLE_OFF / CONSOLE_SUMMARY / CONSOLE_STEP */
+    long console_rate_ms;     /* период сводной строки */
+
+    /* Метрики Prometheus */
+    int metrics_port;         /* 0 — выключено */
+    char metrics_addr[DEV_IP_LEN];
 } IterParams;
 
+/*
+ * Калибровка AO-выхода: фактическое напряжение = gain * заданное + offset,
+ * либо кусочно-линейная характеристика по точкам (задано -> измерено).
+ */
+typedef struct {
+    double gain;
+    double offset_V;
+    int n_points;
+    double cmd_V[CAL_MAX_POINTS];
+    double meas_V[CAL_MAX_POINTS];
+} AoCal;
+
+/* Состояние ПИД-регулятора; коэффициенты ki·dt и kd/dt — на фазу */
+typedef struct {
+    double kp;
+    double ki_dt;
+    double kd_dt;
+    double integ;
+    double y_prev;
+    double err, p, d, u;
+} PidState;
+
+/* Открытое соединение с модулем AO и замеры последнего шага */
+typedef struct {
+    modbus_t *ctx;
+    int sock;
+    struct timespec t_sent;
+    long lat_us;        /* от отправки запроса до подтверждения */
+    int pending;
+    int stale;          /* проверка AO не дождалась ответа, он может прийти позже */
+} AoDevice;
+
+/* Соединение с удалённым модулем AI и последний успешный отсчёт */
+typedef struct {
+    modbus_t *ctx;
+    int sock;
+    int pending;        /* запрос отправлен, ответ не получен */
+    int stale;          /* ответ не пришёл в окне — очистить сокет перед новым запросом */
+    uint16_t tid;       /* MBAP transaction id последнего запроса */
+    struct timespec t_req;
+    double t_ms;        /* оценка момента отсчёта (запрос + RTT/2) от t0 */
+    float val[REMOTE_AI_MAX_CH];
+    long errors;
+} RemoteAi;
+
+/* Контрольная точка: позиция, с которой продолжается прогон */
+typedef struct {
+    uint64_t params_hash;     /* FNV-1a содержимого iter_params.txt */
+    long cycle;               /* 0-базовый цикл */
+    int phase;                /* 0-базовая фаза */
+    long idx;                 /* шаг внутри фазы */
+    long microsteps;
+    char log_file[256];       /* абсолютный путь CSV */
+    off_t log_offset;         /* размер CSV на момент контрольной точки */
+} Checkpoint;
+
+/* Статистика тайминга шага: опоздание пробуждения и запись AO, мкс */
+typedef struct {
+    long n;
+    long late_max, write_max;
+    long long late_sum, write_sum;
+} LoopStats;
+
+/* Группа каналов AI с общим смещением измерения от t_set */
+typedef struct {
+    long offset_us;
+    unsigned mask;
+    int last_ch;              /* старший канал — длина пакетного чтения */
+} AiGroup;
+
+/* Расписание чтения AI внутри шага, группы по возрастанию смещения */
+typedef struct {
+    AiGroup group[8];
+    int n;                    /* 0 — все каналы подряд после settle фазы */
+} AiSched;
+
+/*
+ * Предрасчитанная последовательность шагов фазы.
+ * Для линейной фазы code/mV указывают в статический пул,
+ * для волновой формы code указывает в mmap-образ кэша кодов.
+ */
+typedef struct {
+    const uint16_t *code;
+    const int32_t  *mV;       /* NULL — iter_mV восстанавливается из кода */
+    long            n_steps;
+    long            period_len; /* длина таблицы; шаги идут по кругу */
+    void           *map;      /* mmap-область кэша (NULL для линейной фазы) */
+    size_t          map_len;
+    long            ra_next;  /* шаг, с которого нужна следующая подсказка */
+    const float    *ref_sin;  /* lock-in: опорные sin/cos на момент измерения, */
+    const float    *ref_cos;  /* NULL — фаза без детектирования */
+    AiSched         ai;       /* расписание чтения AI (aiN_settle_ms) */
+} PhaseSeq;
+
+/* Заголовок файла кэша кодов <wave_file>.codes, за ним count x uint16 */
+typedef struct {
+    char     magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    int64_t  src_size;
+    int64_t  src_mtime;
+} WaveCacheHeader;
+
+static uint16_t g_seq_code[MAX_SEQ_STEPS];
+static int32_t  g_seq_mV[MAX_SEQ_STEPS];
+static float    g_ref_sin[MAX_SEQ_STEPS];   /* lock-in: по тем же индексам пула */
+static float    g_ref_cos[MAX_SEQ_STEPS];
+static int16_t  g_code_mV[AO_CODES];
+
+/* AO: код по профилю -> записываемый код; записанный код -> фактическое В */
+static uint16_t g_ao_lut[AO_CAL_CHANNELS][AO_CODES];
+static double   g_ao_V[AO_CAL_CHANNELS][AO_CODES];
+/* AI: калиброванное = gain * сырое + offset */
+static float    g_ai_gain[8];
+static float    g_ai_off[8];
+static long     g_seq_used;
+static int16_t  g_sine_q15[SINE_TABLE_SIZE];
+static long     g_page_size = 4096;
+
+static volatile int g_stop = 0;
+static volatile sig_atomic_t g_trace_req = 0;   /* SIGUSR1: выгрузить самописец */
+
 
 static uint16_t voltage_to_code(double v)
 {
     const double v_min = AO_MIN_V;
     const double v_max = AO_MAX_V;
     const int code_min = 0;
-    const int code_max = 4095;
+    const int code_max = AO_CODE_MAX;
 
     if (v < v_min) v = v_min;
     if (v > v_max) v = v_max;
 
-    double k = (v - v_min) / (v_max - v_min);
-    double code_f = k * (code_max - code_min);
+    double code_f = (v - v_min) * AO_CODES_PER_V;
 
     int code_i = (int)(code_f + 0.5);
     if (code_i < code_min) code_i = code_min;
@@ -80,19 +491,223 @@ static uint16_t voltage_to_code(double v)
 static double code_to_voltage(uint16_t code)
 {
     const double v_min = AO_MIN_V;
-    const double v_max = AO_MAX_V;
-    const int code_min = 0;
-    const int code_max = 4095;
+    const int code_max = AO_CODE_MAX;
 
     if (code > code_max) code = code_max;
 
-    double k = ((double)code - code_min) / (double)(code_max - code_min);
-    return v_min + k * (v_max - v_min);
+    return v_min + (double)code * AO_V_PER_CODE;
+}
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + (int64_t)ts->tv_nsec;
+}
+
+static void ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec  = (time_t)(ns / 1000000000LL);
+    ts->tv_nsec = (long)(ns % 1000000000LL);
+}
+
+/*
+ * Бортовой самописец (trace=1): кольцо последних событий цикла
+ * с метками CLOCK_MONOTONIC. Событие — 16 байт в статическом массиве,
+ * запись — три сохранения по индексу с маской; метки по возможности
+ * берутся из уже прочитанных на шаге часов. Кольцо выгружается в
+ * iter_trace_<время>_NNN.bin по SIGUSR1, при опоздании шага больше
+ * trace_late_us и в конце прогона; iter_trace_json на ПК переводит
+ * выгрузку в JSON для chrome://tracing / Perfetto.
+ *
+ * Файл: сигнатура "ITERTRC1", u32 версия, u32 причина выгрузки,
+ * u64 событий с начала прогона, u32 событий в файле, u32 0, i64 t0_ns,
+ * затем события от старых к новым: i64 t_ns, u32 тип, i32 аргумент
+ * (little-endian, как в памяти ARM).
+ */
+enum {
+    TR_WAKE = 1,        /* пробуждение шага; arg — опоздание, мкс */
+    TR_AO_BEGIN,
+    TR_AO_END,          /* arg — записанный код */
+    TR_DO_BEGIN,
+    TR_DO_END,
+    TR_AI_BEGIN,
+    TR_AI_END,          /* arg — ошибок чтения AI на шаге */
+    TR_RAI_BEGIN,
+    TR_RAI_END,
+    TR_LOG_BEGIN,
+    TR_LOG_END,         /* arg — 1, если строка записана */
+    TR_CON_BEGIN,
+    TR_CON_END,
+    TR_PAUSE_BEGIN,     /* arg — пауза, мс */
+    TR_PAUSE_END,
+    TR_DUMP_BEGIN,      /* arg — номер выгрузки */
+    TR_DUMP_END,
+    TR_LATE,            /* опоздание больше trace_late_us; arg — мкс */
+    TR_OVERRUN,         /* шаг не уложился в период; arg — длительность, мкс */
+    TR_RAI_ERR,         /* ошибка/таймаут удалённого AI; arg — модуль */
+    TR_AO_FAIL,         /* ошибка записи AO, прогон остановлен */
+    TR_PHASE,           /* начало фазы; arg — номер фазы */
+    TR_CHECKPOINT,
+    TR_TRIGGER,         /* фронт DI; arg — номер DI */
+    TR_RECONNECT        /* переподключение модулей перед прогоном; arg — номер */
+};
+
+enum { TRACE_EXIT = 0, TRACE_SIGNAL = 1, TRACE_LATE = 2 };
+
+typedef struct {
+    int64_t  t_ns;
+    uint32_t type;
+    int32_t  arg;
+} TraceEvent;
+
+typedef struct {
+    int on;
+    uint32_t mask;
+    uint64_t head;            /* событий с начала прогона */
+    int64_t t0_ns;
+    long dumps;
+    long auto_dumps;
+    char base[256];           /* имя выгрузки без _NNN.bin */
+} TraceRing;
+
+static TraceEvent g_trace[TRACE_MAX_EVENTS];
+static TraceRing  g_tr;
+
+static void trace_at(uint32_t type, int64_t t_ns, int32_t arg)
+{
+    if (!g_tr.on)
+        return;
+    TraceEvent *e = &g_trace[g_tr.head++ & g_tr.mask];
+    e->t_ns = t_ns;
+    e->type = type;
+    e->arg  = arg;
+}
+
+static void trace_now(uint32_t type, int32_t arg)
+{
+    if (!g_tr.on)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_at(type, timespec_to_ns(&ts), arg);
+}
+
+/* Запись кольца в файл: в потомке (trace_dump_bg) или в конце прогона */
+static int trace_dump(int reason, long no)
+{
+    static const char *const k_reason[] = { "завершение", "SIGUSR1", "опоздание шага" };
+    char path[300];
+    snprintf(path, sizeof(path), "%s_%03ld.bin", g_tr.base, no);
+
+    uint64_t head = g_tr.head;
+    uint32_t n = head < (uint64_t)g_tr.mask + 1 ? (uint32_t)head : g_tr.mask + 1;
+    uint32_t first = (uint32_t)((head - n) & g_tr.mask);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror("Ошибка открытия файла трассировки");
+        return -1;
+    }
+    uint32_t hdr32[2] = { TRACE_VERSION, (uint32_t)reason };
+    uint32_t cnt32[2] = { n, 0 };
+    fwrite(TRACE_MAGIC, 1, 8, f);
+    fwrite(hdr32, sizeof(uint32_t), 2, f);
+    fwrite(&head, sizeof(head), 1, f);
+    fwrite(cnt32, sizeof(uint32_t), 2, f);
+    fwrite(&g_tr.t0_ns, sizeof(int64_t), 1, f);
+    /* кольцо может быть разорвано: хвост, затем начало массива */
+    uint32_t tail = g_tr.mask + 1 - first;
+    if (tail > n)
+        tail = n;
+    fwrite(&g_trace[first], sizeof(TraceEvent), tail, f);
+    fwrite(&g_trace[0], sizeof(TraceEvent), n - tail, f);
+    int rc = fclose(f) == 0 ? 0 : -1;
+
+    printf("Трассировка (%s): %s, событий %u\n", k_reason[reason], path, (unsigned)n);
+    return rc;
+}
+
+/*
+ * Метрики для Prometheus (metrics_port): счётчики, показатели и
+ * гистограммы лежат в общей с HTTP-сервером странице памяти. Писатель
+ * один — цикл шагов, поэтому обновление — атомарные load/store без
+ * барьеров (__ATOMIC_RELAXED), без блокировок и read-modify-write;
+ * сервер — отдельный процесс, читает так же и в цикл не вмешивается.
+ */
+#define MET_BUCKETS 11    /* 10 границ + «+Inf» */
+
+static const long k_met_le_us[MET_BUCKETS - 1] = {
+    10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+
+typedef struct {
+    uint64_t count[MET_BUCKETS];   /* по корзинам, не накопительно */
+    uint64_t sum_us;
+} MetHist;
+
+typedef struct {
+    uint64_t runs;
+    uint64_t steps;
+    uint64_t deadline_misses;      /* опоздание больше wdt_late_us */
+    uint64_t ai_fallbacks;         /* чтение AI не удалось, взято prev_ai */
+    uint64_t ao_errors;
+    uint64_t ao_verify_mismatches; /* чтение регистра AO не совпало с записанным */
+    uint64_t rai_errors;
+    uint64_t modbus_reconnects;    /* переподключения модулей демоном */
+    uint64_t log_rows;
+    int64_t running;
+    int64_t cycle;
+    int64_t phase;
+    int64_t last_late_us;
+    int64_t log_pending_bytes;     /* не сброшено в файл: буфер stdio / блок packed */
+    MetHist late;
+    MetHist ao_write;
+    MetHist ai_read;
+    int done;
+} Metrics;
+
+static Metrics *g_met;
+
+static void met_add(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static void met_set(int64_t *g, int64_t v)
+{
+    __atomic_store_n(g, v, __ATOMIC_RELAXED);
+}
+
+static void met_observe(MetHist *h, long us)
+{
+    int b = 0;
+    while (b < MET_BUCKETS - 1 && us > k_met_le_us[b])
+        ++b;
+    met_add(&h->count[b], 1);
+    met_add(&h->sum_us, us > 0 ? (uint64_t)us : 0);
 }
 
-static double timespec_to_ms(const struct timespec *ts)
+static void log_comment(FILE *f, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Запись привязки CLOCK_MONOTONIC к CLOCK_REALTIME:
+ *   #anchor;<mono_ns>;<realtime_ns>;<погрешность_ns>
+ * REALTIME читается между двумя чтениями MONOTONIC, mono_ns — середина,
+ * погрешность — половина интервала. Возвращает mono_ns.
+ */
+static int64_t write_clock_anchor(FILE *f)
 {
-    return (double)ts->tv_sec * 1000.0 + (double)ts->tv_nsec / 1.0e6;
+    struct timespec m1, r, m2;
+    clock_gettime(CLOCK_MONOTONIC, &m1);
+    clock_gettime(CLOCK_REALTIME, &r);
+    clock_gettime(CLOCK_MONOTONIC, &m2);
+
+    int64_t n1 = timespec_to_ns(&m1);
+    int64_t n2 = timespec_to_ns(&m2);
+    int64_t mono = n1 + (n2 - n1) / 2;
+    log_comment(f, "#anchor;%" PRId64 ";%" PRId64 ";%" PRId64 "\n",
+                mono, timespec_to_ns(&r), (n2 - n1) / 2);
+    return mono;
 }
 
 static void strtrim(char *s)
@@ -108,6 +723,25 @@ static void strtrim(char *s)
 }
 
 
+static void timespec_add_us(struct timespec *ts, long us)
+{
+    if (us <= 0)
+        return;
+
+    ts->tv_sec += us / 1000000L;
+    ts->tv_nsec += (us % 1000000L) * 1000L;
+    while (ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec  += 1;
+    }
+}
+
+static long timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+    return (long)(a->tv_sec - b->tv_sec) * 1000000L +
+           (a->tv_nsec - b->tv_nsec) / 1000L;
+}
+
 static void timespec_add_ms(struct timespec *ts, int ms)
 {
     if (ms <= 0)
@@ -122,19 +756,109 @@ static void timespec_add_ms(struct timespec *ts, int ms)
     }
 }
 
+/* Сон до абсолютного момента: SIGUSR1 (выгрузка самописца) ожидание
+   не сокращает, Ctrl+C — прерывает */
+static void sleep_until(const struct timespec *t)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL) == EINTR && !g_stop)
+        ;
+}
+
 static void wait_with_pause(struct timespec *t_set, int pause_ms)
 {
     if (pause_ms <= 0)
         return;
 
     timespec_add_ms(t_set, pause_ms);
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t_set, NULL);
+    sleep_until(t_set);
 }
 
 static void init_iter_params(IterParams *p)
 {
     p->num_phases = 1;
     p->repeats = 1;
+    p->settle_adaptive = 0;
+    p->ai_integration_mode = 0xA0;
+    p->ai_filter_mask      = 0x00;
+    p->ai_filter_percent   = 0;
+    for (int ch = 0; ch < 8; ++ch)
+        p->ai_settle_us[ch] = -1;
+    p->ai_stagger      = 0;
+    p->settle_mask     = 0xFF;
+    p->settle_count    = 3;
+    p->settle_tol_V    = 0.001;
+    p->settle_poll_us  = 0;
+    p->settle_early    = 0;
+    p->min_period_us   = 1000;
+    p->pid_enabled     = 0;
+    p->pid_channel     = 0;
+    p->pid_kp          = 0.5;
+    p->pid_ki          = 0.0;
+    p->pid_kd          = 0.0;
+    p->pid_out_min_V   = AO_MIN_V;
+    p->pid_out_max_V   = AO_MAX_V;
+    p->calib_file[0]   = '\0';
+    p->num_devices     = 1;
+    for (int i = 0; i < MAX_AO_DEVICES; ++i) {
+        /* адрес по умолчанию только у dev0; devN_ip для N >= 1 обязателен */
+        snprintf(p->devices[i].ip, DEV_IP_LEN, "%s", i == 0 ? ADAM6224_IP : "");
+        p->devices[i].port  = ADAM6224_PORT;
+        p->devices[i].slave = ADAM6224_SLAVE;
+        p->devices[i].reg   = AO0_REG_ADDR;
+    }
+    p->ao_verify_every    = 0;
+    p->ao_verify_slack_us = 0;
+    p->anchor_interval_s = 60;
+    p->checkpoint_enabled = 0;
+    p->wdt_enabled        = 0;
+    p->wdt_timeout_ms     = 1000;
+    p->wdt_late_us        = 1000;
+    p->wdt_safe_code      = AO_CODES / 2;
+    p->wdt_module_timeout = 0;
+    p->wdt_feed_ms        = 1000;
+    p->trig_di            = -1;
+    p->trig_falling       = 0;
+    p->trig_each_cycle    = 0;
+    p->trig_poll_us       = 50;
+    p->sync_do            = -1;
+    p->aggregate          = 0;
+    p->agg_dump_cycles    = 10;
+    p->agg_raw            = 1;
+    p->log_every          = 1;
+    for (int ch = 0; ch < 8; ++ch)
+        p->deadband_V[ch] = -1.0f;
+    p->deadband_enabled   = 0;
+    p->log_max_skip       = 0;
+    p->log_packed         = 0;
+    p->log_quant_nV       = 1000;
+    p->log_block_rows     = 256;
+    p->log_stage_dir[0]   = '\0';
+    p->log_chunk_kb       = 256;
+    p->log_stage_max_kb   = 8192;
+    p->log_fsync          = LOG_FSYNC_CHUNK;
+    snprintf(p->daemon_spool, sizeof(p->daemon_spool), "%s", ITER_SPOOL_DIR);
+    p->daemon_gap_ms      = 1000;
+    p->daemon_poll_ms     = 200;
+    p->trace_enabled      = 0;
+    p->trace_events       = TRACE_MAX_EVENTS;
+    p->trace_late_us      = 1000;
+    p->trace_dump_max     = 10;
+    p->console_mode       = CONSOLE_SUMMARY;
+    p->console_rate_ms    = 1000;
+    p->metrics_port       = 0;
+    snprintf(p->metrics_addr, sizeof(p->metrics_addr), "127.0.0.1");
+    p->num_rai = 0;
+    p->rai_margin_us = SETTLE_MARGIN_US;
+    for (int i = 0; i < MAX_REMOTE_AI; ++i) {
+        p->rai[i].ip[0]     = '\0';
+        p->rai[i].port      = 502;
+        p->rai[i].slave     = 1;
+        p->rai[i].reg       = 0;
+        p->rai[i].count     = 8;
+        p->rai[i].is_signed = 0;
+        p->rai[i].gain      = 1.0;
+        p->rai[i].offset    = 0.0;
+    }
     for (int i = 0; i < MAX_PHASES; ++i) {
         p->phases[i].start_mV  = -5000;
         p->phases[i].end_mV    =  5000;
@@ -142,6 +866,18 @@ static void init_iter_params(IterParams *p)
         p->phases[i].period_ms =   100;
         p->phases[i].settle_ms =    50;
         p->phases[i].pause_ms  =     0;
+        p->phases[i].period_us =     0;
+        p->phases[i].settle_us =     0;
+        p->phases[i].wave_file[0] = '\0';
+        p->phases[i].profile    = PROFILE_LINEAR;
+        p->phases[i].periods    = 1;
+        p->phases[i].amp_mV     = 1000;
+        p->phases[i].offset_mV  = 0;
+        p->phases[i].freq_Hz    = 1.0;
+        p->phases[i].dwell_ms   = 0;
+        p->phases[i].prbs_order = 7;
+        p->phases[i].seed       = 1;
+        p->phases[i].lockin_periods = 0;
     }
 }
 
@@ -153,6 +889,303 @@ static void update_phase_count(IterParams *p, int idx)
         p->num_phases = MAX_PHASES;
 }
 
+static const char *profile_name(ProfileType t)
+{
+    switch (t) {
+    case PROFILE_TRIANGLE:  return "triangle";
+    case PROFILE_SINE:      return "sine";
+    case PROFILE_STAIRCASE: return "staircase";
+    case PROFILE_PRBS:      return "prbs";
+    default:                return "linear";
+    }
+}
+
+static int parse_profile(const char *val, ProfileType *t)
+{
+    for (int i = PROFILE_LINEAR; i <= PROFILE_PRBS; ++i) {
+        if (strcmp(val, profile_name((ProfileType)i)) == 0) {
+            *t = (ProfileType)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Список каналов "0,3,5" или маска "0x29" */
+static unsigned parse_channel_mask(const char *val)
+{
+    if (strncmp(val, "0x", 2) == 0 || strncmp(val, "0X", 2) == 0)
+        return (unsigned)strtoul(val, NULL, 16) & 0xFF;
+
+    unsigned mask = 0;
+    const char *p = val;
+    while (*p) {
+        char *endptr = NULL;
+        long ch = strtol(p, &endptr, 10);
+        if (endptr == p)
+            break;
+        if (ch >= 0 && ch < 8)
+            mask |= 1u << ch;
+        p = endptr;
+        while (*p == ',' || *p == ' ')
+            ++p;
+    }
+    return mask;
+}
+
+/* Ключ вида ao3_gain / dev1_ip: индекс и суффикс */
+static int parse_indexed_key(const char *key, const char *prefix, int max_ch,
+                         int *ch, const char **suffix)
+{
+    size_t lp = strlen(prefix);
+    if (strncmp(key, prefix, lp) != 0 || !isdigit((unsigned char)key[lp]))
+        return 0;
+    char *endptr = NULL;
+    long n = strtol(key + lp, &endptr, 10);
+    if (n < 0 || n >= max_ch || *endptr != '_')
+        return 0;
+    *ch = (int)n;
+    *suffix = endptr + 1;
+    return 1;
+}
+
+/* Ключи, общие для всего прогона; 1 — ключ распознан, -1 — недопустимое значение */
+static int parse_global_key(IterParams *p, const char *key, const char *val)
+{
+    if (strcmp(key, "settle_mode") == 0) {
+        p->settle_adaptive = (strcmp(val, "adaptive") == 0);
+    } else if (strcmp(key, "settle_channels") == 0) {
+        p->settle_mask = parse_channel_mask(val);
+    } else if (strcmp(key, "settle_count") == 0) {
+        p->settle_count = atoi(val);
+    } else if (strcmp(key, "settle_tol_mV") == 0) {
+        p->settle_tol_V = strtod(val, NULL) / 1000.0;
+    } else if (strcmp(key, "settle_poll_us") == 0) {
+        p->settle_poll_us = atol(val);
+    } else if (strcmp(key, "settle_early") == 0) {
+        p->settle_early = atoi(val) != 0;
+    } else if (strcmp(key, "min_period_us") == 0) {
+        p->min_period_us = atol(val);
+    } else if (strcmp(key, "control_mode") == 0) {
+        p->pid_enabled = (strcmp(val, "pid") == 0);
+    } else if (strcmp(key, "pid_channel") == 0) {
+        p->pid_channel = atoi(val);
+    } else if (strcmp(key, "pid_kp") == 0) {
+        p->pid_kp = strtod(val, NULL);
+    } else if (strcmp(key, "pid_ki") == 0) {
+        p->pid_ki = strtod(val, NULL);
+    } else if (strcmp(key, "pid_kd") == 0) {
+        p->pid_kd = strtod(val, NULL);
+    } else if (strcmp(key, "pid_out_min_V") == 0) {
+        p->pid_out_min_V = strtod(val, NULL);
+    } else if (strcmp(key, "pid_out_max_V") == 0) {
+        p->pid_out_max_V = strtod(val, NULL);
+    } else if (strcmp(key, "watchdog") == 0) {
+        p->wdt_enabled = atoi(val) != 0;
+    } else if (strcmp(key, "wdt_timeout_ms") == 0) {
+        p->wdt_timeout_ms = atol(val);
+    } else if (strcmp(key, "wdt_late_us") == 0) {
+        p->wdt_late_us = atol(val);
+    } else if (strcmp(key, "wdt_safe_code") == 0) {
+        p->wdt_safe_code = atoi(val);
+    } else if (strcmp(key, "wdt_module_timeout") == 0) {
+        p->wdt_module_timeout = atoi(val);
+    } else if (strcmp(key, "wdt_feed_ms") == 0) {
+        p->wdt_feed_ms = atol(val);
+    } else if (strcmp(key, "trig_di") == 0) {
+        p->trig_di = atoi(val);
+    } else if (strcmp(key, "trig_edge") == 0) {
+        if (strcmp(val, "rise") == 0)
+            p->trig_falling = 0;
+        else if (strcmp(val, "fall") == 0)
+            p->trig_falling = 1;
+        else {
+            fprintf(stderr, "Ошибка: trig_edge=%s (допустимо rise, fall)\n", val);
+            return -1;
+        }
+    } else if (strcmp(key, "trig_mode") == 0) {
+        if (strcmp(val, "run") == 0)
+            p->trig_each_cycle = 0;
+        else if (strcmp(val, "cycle") == 0)
+            p->trig_each_cycle = 1;
+        else {
+            fprintf(stderr, "Ошибка: trig_mode=%s (допустимо run, cycle)\n", val);
+            return -1;
+        }
+    } else if (strcmp(key, "trig_poll_us") == 0) {
+        p->trig_poll_us = atol(val);
+    } else if (strcmp(key, "sync_do") == 0) {
+        p->sync_do = atoi(val);
+    } else if (strcmp(key, "ao_verify_every") == 0) {
+        p->ao_verify_every = atol(val);
+    } else if (strcmp(key, "ao_verify_slack_us") == 0) {
+        p->ao_verify_slack_us = atol(val);
+    } else if (strcmp(key, "aggregate") == 0) {
+        p->aggregate = atoi(val) != 0;
+    } else if (strcmp(key, "agg_dump_cycles") == 0) {
+        p->agg_dump_cycles = atol(val);
+    } else if (strcmp(key, "agg_raw") == 0) {
+        p->agg_raw = atoi(val) != 0;
+    } else if (strcmp(key, "log_every") == 0) {
+        p->log_every = atol(val);
+    } else if (strcmp(key, "log_deadband_mV") == 0) {
+        /* общее значение; aiN_deadband_mV задаёт канал отдельно */
+        float db = (float)(strtod(val, NULL) / 1000.0);
+        for (int ch = 0; ch < 8; ++ch)
+            p->deadband_V[ch] = db;
+    } else if (strcmp(key, "log_max_skip") == 0) {
+        p->log_max_skip = atol(val);
+    } else if (strcmp(key, "log_format") == 0) {
+        if (strcmp(val, "csv") == 0)
+            p->log_packed = 0;
+        else if (strcmp(val, "packed") == 0)
+            p->log_packed = 1;
+        else {
+            fprintf(stderr, "Ошибка: log_format=%s (допустимо csv, packed)\n", val);
+            return -1;
+        }
+    } else if (strcmp(key, "log_quant_uV") == 0) {
+        p->log_quant_nV = lrint(strtod(val, NULL) * 1000.0);
+    } else if (strcmp(key, "log_block_rows") == 0) {
+        p->log_block_rows = atol(val);
+    } else if (strcmp(key, "log_stage_dir") == 0) {
+        snprintf(p->log_stage_dir, sizeof(p->log_stage_dir), "%s", val);
+    } else if (strcmp(key, "log_chunk_kb") == 0) {
+        p->log_chunk_kb = atol(val);
+    } else if (strcmp(key, "log_stage_max_kb") == 0) {
+        p->log_stage_max_kb = atol(val);
+    } else if (strcmp(key, "log_fsync") == 0) {
+        if (strcmp(val, "chunk") == 0)
+            p->log_fsync = LOG_FSYNC_CHUNK;
+        else if (strcmp(val, "end") == 0)
+            p->log_fsync = LOG_FSYNC_END;
+        else if (strcmp(val, "none") == 0)
+            p->log_fsync = LOG_FSYNC_NONE;
+        else {
+            fprintf(stderr, "Ошибка: log_fsync=%s (допустимо chunk, end, none)\n", val);
+            return -1;
+        }
+    } else if (strcmp(key, "daemon_spool") == 0) {
+        snprintf(p->daemon_spool, sizeof(p->daemon_spool), "%s", val);
+    } else if (strcmp(key, "daemon_gap_ms") == 0) {
+        p->daemon_gap_ms = atol(val);
+    } else if (strcmp(key, "daemon_poll_ms") == 0) {
+        p->daemon_poll_ms = atol(val);
+    } else if (strcmp(key, "trace") == 0) {
+        p->trace_enabled = atoi(val) != 0;
+    } else if (strcmp(key, "trace_events") == 0) {
+        p->trace_events = atol(val);
+    } else if (strcmp(key, "trace_late_us") == 0) {
+        p->trace_late_us = atol(val);
+    } else if (strcmp(key, "trace_dump_max") == 0) {
+        p->trace_dump_max = atol(val);
+    } else if (strcmp(key, "console") == 0) {
+        if (strcmp(val, "off") == 0)
+            p->console_mode = CONSOLE_OFF;
+        else if (strcmp(val, "summary") == 0)
+            p->console_mode = CONSOLE_SUMMARY;
+        else if (strcmp(val, "step") == 0)
+            p->console_mode = CONSOLE_STEP;
+        else {
+            fprintf(stderr, "Ошибка: console=%s (допустимо summary, step, off)\n", val);
+            return -1;
+        }
+    } else if (strcmp(key, "console_rate_ms") == 0) {
+        p->console_rate_ms = atol(val);
+    } else if (strcmp(key, "metrics_port") == 0) {
+        p->metrics_port = atoi(val);
+    } else if (strcmp(key, "metrics_addr") == 0) {
+        snprintf(p->metrics_addr, sizeof(p->metrics_addr), "%s", val);
+    } else if (strcmp(key, "checkpoint") == 0) {
+        p->checkpoint_enabled = atoi(val) != 0;
+    } else if (strcmp(key, "anchor_interval_s") == 0) {
+        p->anchor_interval_s = atol(val);
+    } else if (strcmp(key, "calib_file") == 0) {
+        snprintf(p->calib_file, sizeof(p->calib_file), "%s", val);
+    } else if (strcmp(key, "rai_margin_us") == 0) {
+        p->rai_margin_us = atol(val);
+    } else if (strncmp(key, "rai", 3) == 0) {
+        int n = 0;
+        const char *suffix = NULL;
+        if (!parse_indexed_key(key, "rai", MAX_REMOTE_AI, &n, &suffix))
+            return 0;
+        RemoteAiCfg *r = &p->rai[n];
+        if (strcmp(suffix, "ip") == 0)
+            snprintf(r->ip, sizeof(r->ip), "%s", val);
+        else if (strcmp(suffix, "port") == 0)
+            r->port = atoi(val);
+        else if (strcmp(suffix, "slave") == 0)
+            r->slave = atoi(val);
+        else if (strcmp(suffix, "reg") == 0)
+            r->reg = atoi(val);
+        else if (strcmp(suffix, "count") == 0)
+            r->count = atoi(val);
+        else if (strcmp(suffix, "signed") == 0)
+            r->is_signed = atoi(val) != 0;
+        else if (strcmp(suffix, "gain") == 0)
+            r->gain = strtod(val, NULL);
+        else if (strcmp(suffix, "offset") == 0)
+            r->offset = strtod(val, NULL);
+        else
+            return 0;
+        if (n + 1 > p->num_rai)
+            p->num_rai = n + 1;
+    } else if (strcmp(key, "ai_integration_mode") == 0) {
+        if (strcmp(val, "50_60hz") == 0)
+            p->ai_integration_mode = 0x00;
+        else if (strcmp(val, "user") == 0)
+            p->ai_integration_mode = 0x80;
+        else if (strcmp(val, "high_speed") == 0)
+            p->ai_integration_mode = 0xA0;
+        else {
+            char *endptr = NULL;
+            long mode = strtol(val, &endptr, 0);
+            if (endptr == val || *endptr != '\0') {
+                fprintf(stderr, "Ошибка: ai_integration_mode=%s (допустимо 50_60hz, user, "
+                        "high_speed, 0x00, 0x80, 0xA0)\n", val);
+                return -1;
+            }
+            p->ai_integration_mode = (int)mode;
+        }
+    } else if (strcmp(key, "ai_filter_channels") == 0) {
+        p->ai_filter_mask = parse_channel_mask(val);
+    } else if (strcmp(key, "ai_filter_percent") == 0) {
+        p->ai_filter_percent = atoi(val);
+    } else if (strncmp(key, "ai", 2) == 0) {
+        int ch = 0;
+        const char *suffix = NULL;
+        if (!parse_indexed_key(key, "ai", 8, &ch, &suffix))
+            return 0;
+        if (strcmp(suffix, "deadband_mV") == 0) {
+            p->deadband_V[ch] = (float)(strtod(val, NULL) / 1000.0);
+        } else if (strcmp(suffix, "settle_ms") == 0) {
+            double ms = strtod(val, NULL);
+            p->ai_settle_us[ch] = ms < 0.0 ? -1 : (long)(ms * 1000.0 + 0.5);
+        } else {
+            return 0;
+        }
+    } else {
+        int dev = 0;
+        const char *suffix = NULL;
+        if (!parse_indexed_key(key, "dev", MAX_AO_DEVICES, &dev, &suffix))
+            return 0;
+        AoDeviceCfg *d = &p->devices[dev];
+        if (strcmp(suffix, "ip") == 0)
+            snprintf(d->ip, sizeof(d->ip), "%s", val);
+        else if (strcmp(suffix, "port") == 0)
+            d->port = atoi(val);
+        else if (strcmp(suffix, "slave") == 0)
+            d->slave = atoi(val);
+        else if (strcmp(suffix, "reg") == 0)
+            d->reg = atoi(val);
+        else
+            return 0;
+        if (dev + 1 > p->num_devices)
+            p->num_devices = dev + 1;
+    }
+    return 1;
+}
+
 static int parse_phase_key(const char *key, int *phase_idx, const char **suffix)
 {
     const char *p = NULL;
@@ -217,6 +1250,14 @@ static int load_iter_params(const char *path, IterParams *p)
             continue;
         }
 
+        int rc = parse_global_key(p, key, val);
+        if (rc < 0) {
+            fclose(fp);
+            return -1;
+        }
+        if (rc)
+            continue;
+
         int v = atoi(val);
 
         int phase_idx = 0;
@@ -234,6 +1275,22 @@ static int load_iter_params(const char *path, IterParams *p)
         else if (strcmp(suffix, "period_ms") == 0)      phase->period_ms = v;
         else if (strcmp(suffix, "settle_ms") == 0)      phase->settle_ms = v;
         else if (strcmp(suffix, "pause_ms") == 0)       phase->pause_ms = v;
+        else if (strcmp(suffix, "period_us") == 0)      phase->period_us = atol(val);
+        else if (strcmp(suffix, "settle_us") == 0)      phase->settle_us = atol(val);
+        else if (strcmp(suffix, "wave_file") == 0)
+            snprintf(phase->wave_file, sizeof(phase->wave_file), "%s", val);
+        else if (strcmp(suffix, "profile") == 0) {
+            if (parse_profile(val, &phase->profile) != 0)
+                fprintf(stderr, "Внимание: неизвестный profile=%s, линейный\n", val);
+        }
+        else if (strcmp(suffix, "periods") == 0)        phase->periods = atol(val);
+        else if (strcmp(suffix, "amp_mV") == 0)         phase->amp_mV = v;
+        else if (strcmp(suffix, "offset_mV") == 0)      phase->offset_mV = v;
+        else if (strcmp(suffix, "freq_Hz") == 0)        phase->freq_Hz = strtod(val, NULL);
+        else if (strcmp(suffix, "dwell_ms") == 0)       phase->dwell_ms = v;
+        else if (strcmp(suffix, "prbs_order") == 0)     phase->prbs_order = v;
+        else if (strcmp(suffix, "seed") == 0)           phase->seed = (unsigned)strtoul(val, NULL, 0);
+        else if (strcmp(suffix, "lockin_periods") == 0) phase->lockin_periods = atol(val);
         else if (strcmp(key, "phases") == 0) {
             if (v >= 1 && v <= MAX_PHASES)
                 p->num_phases = v;
@@ -251,276 +1308,4050 @@ static int validate_iter_params(IterParams *p)
     if (p->repeats < 0)
         p->repeats = 1;
 
-    for (int i = 0; i < p->num_phases; ++i) {
-        IterPhase *phase = &p->phases[i];
-        if (phase->step_mV == 0) {
-            fprintf(stderr, "Ошибка (фаза %d): step_mV=0\n", i + 1);
+    if (p->settle_adaptive) {
+        if (p->settle_mask == 0) {
+            fprintf(stderr, "Ошибка: settle_channels не содержит каналов\n");
             return -1;
         }
+        if (p->settle_count < 1)
+            p->settle_count = 1;
+        if (p->settle_tol_V <= 0.0)
+            p->settle_tol_V = 0.001;
+        if (p->settle_poll_us < 0)
+            p->settle_poll_us = 0;
+        if (p->min_period_us < 1)
+            p->min_period_us = 1;
+    }
 
-        int span = phase->end_mV - phase->start_mV;
-        if (span == 0) {
-            fprintf(stderr,
-                    "Внимание (фаза %d): start=end, будет один шаг\n",
-                    i + 1);
-        } else {
-            if ((span > 0 && phase->step_mV < 0) ||
-                (span < 0 && phase->step_mV > 0)) {
-                fprintf(stderr,
-                        "Ошибка (фаза %d): знак step_mV не согласован с направлением\n",
-                        i + 1);
-                return -1;
-            }
+    if (p->ai_integration_mode != 0x00 && p->ai_integration_mode != 0x80 &&
+        p->ai_integration_mode != 0xA0) {
+        fprintf(stderr, "Ошибка: ai_integration_mode — 50_60hz, user или high_speed "
+                "(0x00, 0x80, 0xA0)\n");
+        return -1;
+    }
+    if (p->ai_filter_mask != 0 && (p->ai_filter_percent < 1 || p->ai_filter_percent > 9)) {
+        fprintf(stderr, "Ошибка: ai_filter_percent вне 1..9\n");
+        return -1;
+    }
+    if (p->ai_filter_mask == 0)
+        p->ai_filter_percent = 0;
+
+    p->ai_stagger = 0;
+    for (int ch = 0; ch < 8; ++ch) {
+        if (p->ai_settle_us[ch] >= 0)
+            p->ai_stagger = 1;
+    }
+    if (p->ai_stagger && p->settle_adaptive) {
+        fprintf(stderr, "Ошибка: aiN_settle_ms несовместим с settle_mode=adaptive\n");
+        return -1;
+    }
+
+    if (p->wdt_enabled) {
+        if (p->wdt_safe_code < 0 || p->wdt_safe_code > AO_CODE_MAX) {
+            fprintf(stderr, "Ошибка: wdt_safe_code вне 0..%d\n", AO_CODE_MAX);
+            return -1;
         }
+        if (p->wdt_timeout_ms < 10)
+            p->wdt_timeout_ms = 10;
+        if (p->wdt_late_us < 0)
+            p->wdt_late_us = 0;
+        if (p->wdt_feed_ms < 1)
+            p->wdt_feed_ms = 1;
+    }
 
-        if (phase->period_ms < 1)
-            phase->period_ms = 1;
-        if (phase->settle_ms < 1)
-            phase->settle_ms = phase->period_ms / 2;
-        if (phase->settle_ms >= phase->period_ms)
-            phase->settle_ms = phase->period_ms - 1;
-        if (phase->settle_ms < 0)
-            phase->settle_ms = 0;
-        if (phase->pause_ms < 0)
-            phase->pause_ms = 0;
+    if (p->trig_di >= IO_DI_TOTAL || p->trig_di < -1) {
+        fprintf(stderr, "Ошибка: trig_di вне 0..%d\n", IO_DI_TOTAL - 1);
+        return -1;
     }
+    if (p->trig_poll_us < 0)
+        p->trig_poll_us = 0;
 
-    return 0;
-}
+    if (p->ao_verify_every < 0)
+        p->ao_verify_every = 0;
+    if (p->ao_verify_slack_us < 0)
+        p->ao_verify_slack_us = 0;
 
+    if (p->log_every < 1)
+        p->log_every = 1;
+    if (p->log_max_skip < 0)
+        p->log_max_skip = 0;
+    p->deadband_enabled = 0;
+    for (int ch = 0; ch < 8; ++ch) {
+        if (p->deadband_V[ch] >= 0.0f)
+            p->deadband_enabled = 1;
+    }
+    if (p->log_packed) {
+        /* отсчёт AI квантуется в int32: шаг не мельче PK_AI_RANGE_V / 2^31 */
+        long min_nV = (long)ceil(PK_AI_RANGE_V * 1.0e9 / (double)INT32_MAX);
+        if (p->log_quant_nV < min_nV) {
+            fprintf(stderr, "Внимание: log_quant_uV увеличен до %.3f (диапазон ±%.0f В в int32)\n",
+                    (double)min_nV * 0.001, PK_AI_RANGE_V);
+            p->log_quant_nV = min_nV;
+        }
+        if (p->log_block_rows < 1)
+            p->log_block_rows = 1;
+        if (p->log_block_rows > PK_MAX_BLOCK_ROWS)
+            p->log_block_rows = PK_MAX_BLOCK_ROWS;
+        /* без столбца skipped распакованный лог не отличить от пропусков шагов */
+        if (p->log_every > 1 || p->deadband_enabled) {
+            fprintf(stderr, "Ошибка: log_format=packed несовместим с прореживанием "
+                    "(log_every, log_deadband_mV, aiN_deadband_mV)\n");
+            return -1;
+        }
+        if (p->settle_adaptive || p->pid_enabled || p->num_devices > 1 ||
+            p->num_rai > 0 || p->sync_do >= 0 ||
+            p->ao_verify_every > 0 || p->ao_verify_slack_us > 0 || p->ai_stagger)
+            fprintf(stderr, "Внимание: log_format=packed хранит только стандартные столбцы\n");
+    }
 
-static volatile int g_stop = 0;
+    if (p->log_stage_dir[0] != '\0') {
+        if (p->log_chunk_kb < 4)
+            p->log_chunk_kb = 4;
+        if (p->log_stage_max_kb < 2 * p->log_chunk_kb) {
+            fprintf(stderr, "Внимание: log_stage_max_kb увеличен до %ld (2 x log_chunk_kb)\n",
+                    2 * p->log_chunk_kb);
+            p->log_stage_max_kb = 2 * p->log_chunk_kb;
+        }
+    }
 
-static void handle_sigint(int sig)
-{
-    (void)sig;
-    g_stop = 1;
-}
+    if (p->daemon_gap_ms < 0)
+        p->daemon_gap_ms = 0;
+    if (p->daemon_poll_ms < 10)
+        p->daemon_poll_ms = 10;
 
+    if (p->trace_enabled) {
+        long n = TRACE_MIN_EVENTS;
+        while (n < p->trace_events && n < TRACE_MAX_EVENTS)
+            n <<= 1;
+        p->trace_events = n;
+        if (p->trace_late_us < 0)
+            p->trace_late_us = 0;
+        if (p->trace_dump_max < 0)
+            p->trace_dump_max = 0;
+    }
 
+    if (p->console_rate_ms < 10)
+        p->console_rate_ms = 10;
 
-int main(void)
-{
-    IterParams par;
-    if (load_iter_params(ITER_PARAMS_FILE, &par) != 0) {
+    if (p->metrics_port < 0 || p->metrics_port > 65535) {
+        fprintf(stderr, "Ошибка: metrics_port вне 0..65535\n");
         return -1;
     }
 
-    if (validate_iter_params(&par) != 0) {
+    if (p->sync_do >= IO_DO_TOTAL || p->sync_do < -1) {
+        fprintf(stderr, "Ошибка: sync_do вне 0..%d\n", IO_DO_TOTAL - 1);
         return -1;
     }
 
-    printf("Параметры (фаз: %d):\n", par.num_phases);
-    for (int i = 0; i < par.num_phases; ++i) {
-        IterPhase *phase = &par.phases[i];
-        printf("  Фаза %d:\n", i + 1);
-        printf("    start_mV  = %d\n", phase->start_mV);
-        printf("    end_mV    = %d\n", phase->end_mV);
-        printf("    step_mV   = %d\n", phase->step_mV);
-        printf("    period_ms = %d\n", phase->period_ms);
-        printf("    settle_ms = %d\n", phase->settle_ms);
-        printf("    pause_ms  = %d\n", phase->pause_ms);
+    if (p->rai_margin_us < 0)
+        p->rai_margin_us = 0;
+    for (int i = 0; i < p->num_rai; ++i) {
+        RemoteAiCfg *r = &p->rai[i];
+        if (r->ip[0] == '\0') {
+            fprintf(stderr, "Ошибка: rai%d_ip не задан\n", i);
+            return -1;
+        }
+        if (r->count < 1 || r->count > REMOTE_AI_MAX_CH) {
+            fprintf(stderr, "Ошибка: rai%d_count вне 1..%d\n", i, REMOTE_AI_MAX_CH);
+            return -1;
+        }
     }
-    printf("  repeats = %ld (0 = бесконечный цикл)\n", par.repeats);
-    printf("\n");
 
-    /* Заготовка лога CSV */
-    char fname[128];
-    {
-        time_t now = time(NULL);
-        struct tm tm_now;
-        localtime_r(&now, &tm_now);
+    for (int i = 1; i < p->num_devices; ++i) {
+        if (p->devices[i].ip[0] == '\0') {
+            fprintf(stderr, "Ошибка: dev%d_ip не задан (модули AO 0..%d должны идти без пропусков)\n",
+                    i, p->num_devices - 1);
+            return -1;
+        }
+    }
 
-        snprintf(fname, sizeof(fname),
-                 "iter_8ch_%04d%02d%02d_%02d%02d%02d.csv",
-                 tm_now.tm_year + 1900,
-                 tm_now.tm_mon + 1,
-                 tm_now.tm_mday,
-                 tm_now.tm_hour,
-                 tm_now.tm_min,
-                 tm_now.tm_sec);
+    if (p->pid_enabled) {
+        if (p->pid_channel < 0 || p->pid_channel > 7) {
+            fprintf(stderr, "Ошибка: pid_channel=%d вне 0..7\n", p->pid_channel);
+            return -1;
+        }
+        if (p->pid_out_min_V < AO_MIN_V) p->pid_out_min_V = AO_MIN_V;
+        if (p->pid_out_max_V > AO_MAX_V) p->pid_out_max_V = AO_MAX_V;
+        if (p->pid_out_min_V >= p->pid_out_max_V) {
+            fprintf(stderr, "Ошибка: pid_out_min_V >= pid_out_max_V\n");
+            return -1;
+        }
+        if (p->settle_early) {
+            fprintf(stderr, "Внимание: settle_early несовместим с control_mode=pid, отключён\n");
+            p->settle_early = 0;
+        }
+    }
+
+    for (int i = 0; i < p->num_phases; ++i) {
+        IterPhase *phase = &p->phases[i];
+
+        if (phase->period_ms < 1)
+            phase->period_ms = 1;
+        if (phase->period_us <= 0)
+            phase->period_us = (long)phase->period_ms * 1000L;
+        if (phase->settle_us <= 0)
+            phase->settle_us = (long)phase->settle_ms * 1000L;
+        if (phase->period_us < 1)
+            phase->period_us = 1;
+        if (phase->settle_us < 1)
+            phase->settle_us = phase->period_us / 2;
+        {
+            /* Как в исходной версии: не меньше 1 мс до конца шага на чтение AI и лог */
+            long margin = SETTLE_MARGIN_US;
+            if (margin > phase->period_us / 2)
+                margin = phase->period_us / 2;
+            if (phase->settle_us > phase->period_us - margin) {
+                phase->settle_us = phase->period_us - margin;
+                fprintf(stderr,
+                        "Внимание (фаза %d): settle уменьшен до %ld мкс "
+                        "(запас %ld мкс до конца шага)\n",
+                        i + 1, phase->settle_us, margin);
+            }
+        }
+        for (int ch = 0; ch < 8; ++ch) {
+            if (p->ai_settle_us[ch] >= phase->period_us) {
+                fprintf(stderr, "Ошибка (фаза %d): ai%d_settle_ms не меньше периода шага\n",
+                        i + 1, ch);
+                return -1;
+            }
+        }
+        if (phase->pause_ms < 0)
+            phase->pause_ms = 0;
+
+        if (phase->periods < 1)
+            phase->periods = 1;
+
+        if (phase->lockin_periods < 0)
+            phase->lockin_periods = 0;
+        if (phase->lockin_periods > 0) {
+            if (phase->wave_file[0] != '\0' || phase->profile != PROFILE_SINE) {
+                fprintf(stderr, "Ошибка (фаза %d): lockin_periods только для profile=sine\n",
+                        i + 1);
+                return -1;
+            }
+            /* опоры привязаны к номеру шага: нужен синус кодов на ровной сетке */
+            if (p->pid_enabled || (p->settle_adaptive && p->settle_early)) {
+                fprintf(stderr, "Ошибка (фаза %d): lockin_periods несовместим с "
+                        "control_mode=pid и settle_early=1\n", i + 1);
+                return -1;
+            }
+            if (phase->periods % phase->lockin_periods != 0)
+                fprintf(stderr,
+                        "Внимание (фаза %d): periods не кратно lockin_periods, "
+                        "неполный последний блок отбрасывается\n", i + 1);
+        }
+
+        /* Для волновой формы линейные параметры не используются */
+        if (phase->wave_file[0] != '\0')
+            continue;
+
+        if (phase->profile == PROFILE_SINE) {
+            if (phase->freq_Hz <= 0.0) {
+                fprintf(stderr, "Ошибка (фаза %d): freq_Hz должна быть > 0\n", i + 1);
+                return -1;
+            }
+            /* в double до lrint: на 32-битном long отношение может не поместиться */
+            double steps = 1.0e6 / (phase->freq_Hz * (double)phase->period_us);
+            if (!(steps <= (double)MAX_SEQ_STEPS)) {
+                fprintf(stderr,
+                        "Ошибка (фаза %d): freq_Hz=%g даёт %.0f шагов на период (максимум %d)\n",
+                        i + 1, phase->freq_Hz, steps, MAX_SEQ_STEPS);
+                return -1;
+            }
+            continue;
+        }
+        if (phase->profile == PROFILE_PRBS) {
+            if (phase->prbs_order < PRBS_MIN_ORDER || phase->prbs_order > PRBS_MAX_ORDER) {
+                fprintf(stderr, "Ошибка (фаза %d): prbs_order вне %d..%d\n",
+                        i + 1, PRBS_MIN_ORDER, PRBS_MAX_ORDER);
+                return -1;
+            }
+            continue;
+        }
+
+        if (phase->step_mV == 0) {
+            fprintf(stderr, "Ошибка (фаза %d): step_mV=0\n", i + 1);
+            return -1;
+        }
+
+        int span = phase->end_mV - phase->start_mV;
+        if (span == 0) {
+            fprintf(stderr,
+                    "Внимание (фаза %d): start=end, будет один шаг\n",
+                    i + 1);
+        } else {
+            if ((span > 0 && phase->step_mV < 0) ||
+                (span < 0 && phase->step_mV > 0)) {
+                fprintf(stderr,
+                        "Ошибка (фаза %d): знак step_mV не согласован с направлением\n",
+                        i + 1);
+                return -1;
+            }
+        }
+
+    }
+
+    return 0;
+}
+
+static void init_code_mV_table(void)
+{
+    for (int code = 0; code < 4096; ++code) {
+        double v = code_to_voltage((uint16_t)code);
+        g_code_mV[code] = (int16_t)(v >= 0.0 ? v * 1000.0 + 0.5
+                                             : v * 1000.0 - 0.5);
+    }
+}
+
+static int is_text_wave(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    return ext && (strcmp(ext, ".csv") == 0 || strcmp(ext, ".txt") == 0);
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+    size_t ls = strlen(s), lx = strlen(suffix);
+    return ls >= lx && strcmp(s + ls - lx, suffix) == 0;
+}
+
+/*
+ * Однократное преобразование исходной волновой формы в упакованный
+ * массив кодов ЦАП. Исходник читается потоково, поэтому размер файла
+ * не ограничен объёмом ОЗУ.
+ *   *.csv / *.txt — по одному значению в мВ на строку (первый столбец,
+ *                   строки-комментарии и заголовки пропускаются);
+ *   прочие файлы  — двоичный int16 little-endian, мВ.
+ */
+static int convert_wave_file(const char *src, const char *cache,
+                             const struct stat *st_src)
+{
+    FILE *in = fopen(src, is_text_wave(src) ? "r" : "rb");
+    if (!in) {
+        perror("Ошибка открытия wave_file");
+        return -1;
+    }
+
+    char tmp[WAVE_PATH_LEN + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        perror("Ошибка создания кэша волновой формы");
+        fclose(in);
+        return -1;
+    }
+
+    WaveCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WAVE_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.src_size  = (int64_t)st_src->st_size;
+    hdr.src_mtime = (int64_t)st_src->st_mtime;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    uint16_t buf[4096];
+    size_t nbuf = 0;
+    uint64_t count = 0;
+    int err = 0;
+
+    if (is_text_wave(src)) {
+        char line[256];
+        while (fgets(line, sizeof(line), in)) {
+            strtrim(line);
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+            char *endptr = NULL;
+            double mV = strtod(line, &endptr);
+            if (endptr == line)
+                continue;
+            buf[nbuf++] = voltage_to_code(mV / 1000.0);
+            if (nbuf == sizeof(buf) / sizeof(buf[0])) {
+                if (fwrite(buf, sizeof(buf[0]), nbuf, out) != nbuf) { err = 1; break; }
+                count += nbuf;
+                nbuf = 0;
+            }
+        }
+    } else {
+        unsigned char raw[2 * 4096];
+        size_t n;
+        while ((n = fread(raw, 2, 4096, in)) > 0) {
+            for (size_t i = 0; i < n; ++i) {
+                int16_t mV = (int16_t)(raw[2 * i] | (raw[2 * i + 1] << 8));
+                buf[i] = voltage_to_code((double)mV / 1000.0);
+            }
+            if (fwrite(buf, sizeof(buf[0]), n, out) != n) { err = 1; break; }
+            count += n;
+        }
+    }
+    if (!err && nbuf > 0) {
+        if (fwrite(buf, sizeof(buf[0]), nbuf, out) != nbuf)
+            err = 1;
+        count += nbuf;
+    }
+    fclose(in);
+
+    if (count == 0 || count > UINT32_MAX) {
+        fprintf(stderr, "Ошибка: wave_file %s не содержит пригодных отсчётов\n", src);
+        err = 1;
+    }
+
+    hdr.count = (uint32_t)count;
+    if (!err) {
+        if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+            err = 1;
+    }
+    if (fclose(out) != 0)
+        err = 1;
+
+    if (err || rename(tmp, cache) != 0) {
+        if (!err)
+            perror("Ошибка записи кэша волновой формы");
+        unlink(tmp);
+        return -1;
+    }
+
+    printf("Волновая форма %s преобразована: %lu отсчётов -> %s\n",
+           src, (unsigned long)count, cache);
+    return 0;
+}
+
+/* Проверка, что кэш соответствует исходнику (размер и mtime) */
+static int wave_cache_is_fresh(const char *cache, const struct stat *st_src)
+{
+    FILE *fp = fopen(cache, "rb");
+    if (!fp)
+        return 0;
+
+    WaveCacheHeader hdr;
+    int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             memcmp(hdr.magic, WAVE_CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+             (!st_src || (hdr.src_size  == (int64_t)st_src->st_size &&
+                          hdr.src_mtime == (int64_t)st_src->st_mtime));
+    fclose(fp);
+    return ok;
+}
+
+static int map_wave_phase(const IterPhase *phase, PhaseSeq *seq)
+{
+    char cache[WAVE_PATH_LEN + 8];
+    struct stat st_src;
+    int prepacked = ends_with(phase->wave_file, WAVE_CACHE_EXT);
+
+    if (prepacked) {
+        snprintf(cache, sizeof(cache), "%s", phase->wave_file);
+    } else {
+        snprintf(cache, sizeof(cache), "%s%s", phase->wave_file, WAVE_CACHE_EXT);
+        if (stat(phase->wave_file, &st_src) != 0) {
+            perror("Ошибка stat wave_file");
+            return -1;
+        }
+    }
+
+    if (!wave_cache_is_fresh(cache, prepacked ? NULL : &st_src)) {
+        if (prepacked) {
+            fprintf(stderr, "Ошибка: %s не является кэшем кодов\n", cache);
+            return -1;
+        }
+        if (convert_wave_file(phase->wave_file, cache, &st_src) != 0)
+            return -1;
+    }
+
+    int fd = open(cache, O_RDONLY);
+    if (fd < 0) {
+        perror("Ошибка открытия кэша волновой формы");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(WaveCacheHeader)) {
+        fprintf(stderr, "Ошибка: повреждён кэш %s\n", cache);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Ошибка mmap волновой формы");
+        return -1;
+    }
+
+    const WaveCacheHeader *hdr = (const WaveCacheHeader *)map;
+    size_t need = sizeof(*hdr) + (size_t)hdr->count * sizeof(uint16_t);
+    if (hdr->count == 0 || need > (size_t)st.st_size) {
+        fprintf(stderr, "Ошибка: усечённый кэш %s\n", cache);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    /* Чтение строго последовательное: ядро может вытеснять пройденное */
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    seq->map     = map;
+    seq->map_len = (size_t)st.st_size;
+    seq->code    = (const uint16_t *)((const char *)map + sizeof(*hdr));
+    seq->mV      = NULL;
+    seq->n_steps = (long)hdr->count;
+    seq->ra_next = 0;
+    return 0;
+}
+
+/* Подсказка ядру подгрузить следующее окно кодов; per-step — одно сравнение */
+static void wave_readahead(PhaseSeq *seq, long idx)
+{
+    if (!seq->map || idx < seq->ra_next)
+        return;
+
+    size_t off = sizeof(WaveCacheHeader) + (size_t)idx * sizeof(uint16_t);
+    size_t start = off & ~((size_t)g_page_size - 1);
+    size_t len = 2 * WAVE_READAHEAD_STEPS * sizeof(uint16_t) + (off - start);
+    if (start + len > seq->map_len)
+        len = seq->map_len - start;
+
+    madvise((char *)seq->map + start, len, MADV_WILLNEED);
+    seq->ra_next = idx + WAVE_READAHEAD_STEPS;
+}
+
+/* Добавление шага в общий пул; -1 при переполнении */
+static int seq_push(int mV)
+{
+    if (g_seq_used >= MAX_SEQ_STEPS)
+        return -1;
+    g_seq_mV[g_seq_used]   = mV;
+    g_seq_code[g_seq_used] = voltage_to_code((double)mV / 1000.0);
+    ++g_seq_used;
+    return 0;
+}
+
+static void init_sine_table(void)
+{
+    for (int i = 0; i < SINE_TABLE_SIZE; ++i)
+        g_sine_q15[i] = (int16_t)lrint(32767.0 * sin(2.0 * M_PI * i / SINE_TABLE_SIZE));
+}
+
+/* Синус Q15 с линейной интерполяцией; полный оборот фазы = 2^32 */
+static int sine_q15(uint32_t ph)
+{
+    uint32_t i = ph >> (32 - SINE_TABLE_BITS);
+    int frac = (int)((ph >> (32 - SINE_TABLE_BITS - 15)) & 0x7FFF);
+    int a = g_sine_q15[i];
+    int b = g_sine_q15[(i + 1) & (SINE_TABLE_SIZE - 1)];
+    return a + (((b - a) * frac) >> 15);
+}
+
+/* Маски отводов LFSR максимальной длины для порядков 2..15 */
+static const uint16_t k_prbs_taps[PRBS_MAX_ORDER + 1] = {
+    0, 0, 0x3, 0x6, 0xC, 0x14, 0x30, 0x60, 0xB8,
+    0x110, 0x240, 0x500, 0xE08, 0x1C80, 0x3802, 0x6000
+};
+
+static long dwell_steps(const IterPhase *phase)
+{
+    long n = (long)phase->dwell_ms * 1000L / phase->period_us;
+    return n < 1 ? 1 : n;
+}
+
+/*
+ * Генераторы профиля: один период записывается в пул целочисленно
+ * (синус — по таблице), повторы периода идут по кругу без затрат на шаг.
+ */
+static long gen_linear(const IterPhase *phase, int dwell)
+{
+    long n = (long)(phase->end_mV - phase->start_mV) / phase->step_mV + 1;
+    int mV = phase->start_mV;
+    for (long k = 0; k < n; ++k, mV += phase->step_mV) {
+        for (int d = 0; d < dwell; ++d) {
+            if (seq_push(mV) != 0)
+                return -1;
+        }
+    }
+    return n * dwell;
+}
+
+static long gen_triangle(const IterPhase *phase)
+{
+    long up = gen_linear(phase, 1);
+    if (up < 0)
+        return -1;
+    /* обратный ход без крайних точек: период замыкается на start */
+    int mV = phase->start_mV + (int)(up - 1) * phase->step_mV;
+    for (long k = up - 2; k >= 1; --k) {
+        mV -= phase->step_mV;
+        if (seq_push(mV) != 0)
+            return -1;
+    }
+    return up < 2 ? up : 2 * up - 2;
+}
+
+static long gen_sine(const IterPhase *phase)
+{
+    /* целое число шагов на период — профиль повторяется без дрейфа фазы */
+    long n = lrint(1.0e6 / (phase->freq_Hz * (double)phase->period_us));
+    if (n < 2)
+        n = 2;
+    for (long k = 0; k < n; ++k) {
+        uint32_t ph = (uint32_t)(((uint64_t)k << 32) / (uint64_t)n);
+        int mV = phase->offset_mV + (int)(((int64_t)phase->amp_mV * sine_q15(ph) + (1 << 14)) >> 15);
+        if (seq_push(mV) != 0)
+            return -1;
+    }
+    return n;
+}
+
+static long gen_prbs(const IterPhase *phase, long dwell)
+{
+    int order = phase->prbs_order;
+    uint32_t mask = (1u << order) - 1u;
+    uint32_t state = phase->seed & mask;
+    if (state == 0)
+        state = 1;
+
+    long n = (long)mask;
+    for (long k = 0; k < n; ++k) {
+        uint32_t fb = (uint32_t)__builtin_parity(state & k_prbs_taps[order]);
+        state = ((state << 1) | fb) & mask;
+        int mV = fb ? phase->end_mV : phase->start_mV;
+        for (long d = 0; d < dwell; ++d) {
+            if (seq_push(mV) != 0)
+                return -1;
+        }
+    }
+    return n * dwell;
+}
+
+/*
+ * Опорные sin/cos lock-in на каждый шаг периода: фаза опоры 2πk/n по номеру
+ * отсчёта, как у кода AO шага k (gen_sine), поэтому петля AO0 -> AI даёт
+ * фазу 0. Ступенчатое удержание AO (ZOH) сдвигает основную гармонику
+ * выхода на −180°/n относительно кодов; эта поправка не вносится.
+ * Таблицы лежат в пуле по тем же индексам, что и коды фазы.
+ */
+static void build_lockin_refs(PhaseSeq *seq)
+{
+    long base = seq->code - g_seq_code;
+    for (long k = 0; k < seq->period_len; ++k) {
+        double w = 2.0 * M_PI * (double)k / (double)seq->period_len;
+        g_ref_sin[base + k] = (float)sin(w);
+        g_ref_cos[base + k] = (float)cos(w);
+    }
+    seq->ref_sin = &g_ref_sin[base];
+    seq->ref_cos = &g_ref_cos[base];
+}
+
+/*
+ * Расписание чтения AI фазы: смещение канала — aiN_settle_ms или settle
+ * фазы; каналы с одинаковым смещением объединяются в группу.
+ */
+static void build_ai_sched(const IterParams *p, const IterPhase *phase, AiSched *sc)
+{
+    sc->n = 0;
+    for (int ch = 0; ch < 8; ++ch) {
+        long off = p->ai_settle_us[ch] >= 0 ? p->ai_settle_us[ch] : phase->settle_us;
+        int g = 0;
+        while (g < sc->n && sc->group[g].offset_us < off)
+            ++g;
+        if (g < sc->n && sc->group[g].offset_us == off) {
+            sc->group[g].mask |= 1u << ch;
+            sc->group[g].last_ch = ch;
+            continue;
+        }
+        memmove(&sc->group[g + 1], &sc->group[g], (size_t)(sc->n - g) * sizeof(AiGroup));
+        sc->group[g].offset_us = off;
+        sc->group[g].mask      = 1u << ch;
+        sc->group[g].last_ch   = ch;
+        ++sc->n;
+    }
+}
+
+/* Предрасчёт последовательностей всех фаз до t0 */
+static int build_phase_seqs(const IterParams *p, PhaseSeq *seqs)
+{
+    g_page_size = sysconf(_SC_PAGESIZE);
+    if (g_page_size <= 0)
+        g_page_size = 4096;
+    init_code_mV_table();
+    init_sine_table();
+    g_seq_used = 0;
+
+    for (int i = 0; i < p->num_phases; ++i) {
+        const IterPhase *phase = &p->phases[i];
+        PhaseSeq *seq = &seqs[i];
+        memset(seq, 0, sizeof(*seq));
+        if (p->ai_stagger)
+            build_ai_sched(p, phase, &seq->ai);
+
+        if (phase->wave_file[0] != '\0') {
+            if (map_wave_phase(phase, seq) != 0) {
+                fprintf(stderr, "Ошибка (фаза %d): wave_file=%s\n",
+                        i + 1, phase->wave_file);
+                return -1;
+            }
+            seq->period_len = seq->n_steps;
+            continue;
+        }
+
+        seq->code = &g_seq_code[g_seq_used];
+        seq->mV   = &g_seq_mV[g_seq_used];
+
+        long n;
+        switch (phase->profile) {
+        case PROFILE_TRIANGLE:  n = gen_triangle(phase); break;
+        case PROFILE_SINE:      n = gen_sine(phase); break;
+        case PROFILE_STAIRCASE: n = gen_linear(phase, (int)dwell_steps(phase)); break;
+        case PROFILE_PRBS:      n = gen_prbs(phase, dwell_steps(phase)); break;
+        default:                n = gen_linear(phase, 1); break;
+        }
+        if (n < 0) {
+            fprintf(stderr,
+                    "Ошибка (фаза %d): всего шагов больше %d\n",
+                    i + 1, MAX_SEQ_STEPS);
+            return -1;
+        }
+
+        seq->period_len = n;
+        seq->n_steps    = n * phase->periods;
+        if (phase->lockin_periods > 0)
+            build_lockin_refs(seq);
+        /* треугольник замыкается возвратом в start */
+        if (phase->profile == PROFILE_TRIANGLE && n > 1)
+            seq->n_steps += 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Чтение AI по расписанию шага: ожидание до t_set + смещение группы,
+ * группа из нескольких каналов читается одним AI_GetFloatValues
+ * (каналы 0..старший), одиночный канал — AI_GetFloatValue. Момент
+ * отсчёта канала — середина вызова. При ошибке берётся предыдущее
+ * значение. Возвращает число ошибок, *read_us — время самих чтений.
+ */
+static int ai_read_sched(int fd_io, const AiSched *sc, const struct timespec *t_set,
+                         float *ai_raw, float *prev_ai, int64_t *t_ch_ns, long *read_us)
+{
+    int err = 0;
+    *read_us = 0;
+    for (int g = 0; g < sc->n; ++g) {
+        const AiGroup *gr = &sc->group[g];
+        struct timespec t_go = *t_set, t_begin, t_end;
+        timespec_add_us(&t_go, gr->offset_us);
+        sleep_until(&t_go);
+
+        float val[8];
+        unsigned char st[8] = {0};
+        unsigned int ret;
+        clock_gettime(CLOCK_MONOTONIC, &t_begin);
+        if (gr->mask & (gr->mask - 1))
+            ret = AI_GetFloatValues(fd_io, gr->last_ch + 1, val, st);
+        else
+            ret = AI_GetFloatValue(fd_io, gr->last_ch, &val[gr->last_ch], st);
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+        int64_t t_begin_ns = timespec_to_ns(&t_begin);
+        int64_t t_mid_ns = t_begin_ns + (timespec_to_ns(&t_end) - t_begin_ns) / 2;
+        *read_us += timespec_diff_us(&t_end, &t_begin);
+        for (int ch = 0; ch <= gr->last_ch; ++ch) {
+            if (!(gr->mask & (1u << ch)))
+                continue;
+            if (ret != 0) {
+                ai_raw[ch] = prev_ai[ch];
+                ++err;
+            } else {
+                ai_raw[ch] = val[ch];
+                prev_ai[ch] = val[ch];
+            }
+            t_ch_ns[ch] = t_mid_ns;
+        }
+    }
+    return err;
+}
+
+/*
+ * Адаптивное ожидание: опрос выбранных AI сразу после записи AO.
+ * Установление — K подряд отсчётов в полосе ±tol вокруг опорного
+ * значения; верхняя граница — t_meas (t_set + settle_us).
+ * Возвращает фактическое время установления от t_set, мкс.
+ */
+static long adaptive_settle(int fd_io, const IterParams *p,
+                            const struct timespec *t_set,
+                            const struct timespec *t_meas)
+{
+    float ref[8] = {0};
+    int count = 0;      /* отсчётов подряд в полосе, включая опорный */
+    struct timespec t_now;
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+        if (timespec_diff_us(&t_now, t_meas) >= 0)
+            return timespec_diff_us(t_meas, t_set);
+
+        float cur[8];
+        int in_band = count > 0;
+        for (int ch = 0; ch < 8; ++ch) {
+            if (!(p->settle_mask & (1u << ch)))
+                continue;
+            unsigned char st = 0;
+            if (AI_GetFloatValue(fd_io, ch, &cur[ch], &st) != 0) {
+                cur[ch] = ref[ch];
+                in_band = 0;
+            } else if (fabsf(cur[ch] - ref[ch]) > (float)p->settle_tol_V) {
+                in_band = 0;
+            }
+        }
+
+        if (in_band) {
+            ++count;
+        } else {
+            /* новый опорный отсчёт — счёт начинается заново */
+            for (int ch = 0; ch < 8; ++ch) {
+                if (p->settle_mask & (1u << ch))
+                    ref[ch] = cur[ch];
+            }
+            count = 1;
+        }
+
+        if (count >= p->settle_count) {
+            clock_gettime(CLOCK_MONOTONIC, &t_now);
+            return timespec_diff_us(&t_now, t_set);
+        }
+
+        if (p->settle_poll_us > 0) {
+            struct timespec t_poll = t_now;
+            timespec_add_us(&t_poll, p->settle_poll_us);
+            if (timespec_diff_us(&t_poll, t_meas) > 0)
+                t_poll = *t_meas;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_poll, NULL);
+        }
+    }
+}
+
+static void pid_init(PidState *pid, double y0)
+{
+    memset(pid, 0, sizeof(*pid));
+    pid->y_prev = y0;
+}
+
+/* Пересчёт коэффициентов при смене периода фазы (фиксированный dt) */
+static void pid_set_period(PidState *pid, const IterParams *p, long period_us)
+{
+    double dt = (double)period_us * 1.0e-6;
+    pid->kp    = p->pid_kp;
+    pid->ki_dt = p->pid_ki * dt;
+    pid->kd_dt = p->pid_kd / dt;
+}
+
+/*
+ * Шаг ПИД: D — по измерению (без скачка при смене уставки),
+ * анти-виндап — условное интегрирование: интеграл не растёт,
+ * пока выход в насыщении и ошибка толкает его дальше.
+ */
+static double pid_update(PidState *pid, const IterParams *p, double sp, double y)
+{
+    pid->err = sp - y;
+    pid->p   = pid->kp * pid->err;
+    pid->d   = -pid->kd_dt * (y - pid->y_prev);
+    pid->y_prev = y;
+
+    double integ = pid->integ + pid->ki_dt * pid->err;
+    double u = pid->p + integ + pid->d;
+
+    if (u > p->pid_out_max_V) {
+        u = p->pid_out_max_V;
+        if (pid->err < 0.0)
+            pid->integ = integ;
+    } else if (u < p->pid_out_min_V) {
+        u = p->pid_out_min_V;
+        if (pid->err > 0.0)
+            pid->integ = integ;
+    } else {
+        pid->integ = integ;
+    }
+
+    pid->u = u;
+    return u;
+}
+
+static void loop_stats_add(LoopStats *st, long late_us, long write_us)
+{
+    st->n++;
+    st->late_sum  += late_us;
+    st->write_sum += write_us;
+    if (late_us > st->late_max)   st->late_max = late_us;
+    if (write_us > st->write_max) st->write_max = write_us;
+}
+
+/* Фактическое напряжение AO при заданном (идеальном) напряжении v */
+static double ao_cal_forward(const AoCal *c, double v)
+{
+    if (c->n_points < 2)
+        return c->gain * v + c->offset_V;
+
+    int i = 1;
+    while (i < c->n_points - 1 && v > c->cmd_V[i])
+        ++i;
+    double dx = c->cmd_V[i] - c->cmd_V[i - 1];
+    if (dx == 0.0)
+        return c->meas_V[i];
+    return c->meas_V[i - 1] +
+           (v - c->cmd_V[i - 1]) * (c->meas_V[i] - c->meas_V[i - 1]) / dx;
+}
+
+/* Заданное напряжение, при котором на выходе будет v (обратная функция) */
+static double ao_cal_inverse(const AoCal *c, double v)
+{
+    if (c->n_points < 2)
+        return (v - c->offset_V) / c->gain;
+
+    int i = 1;
+    while (i < c->n_points - 1 && v > c->meas_V[i])
+        ++i;
+    double dy = c->meas_V[i] - c->meas_V[i - 1];
+    if (dy == 0.0)
+        return c->cmd_V[i];
+    return c->cmd_V[i - 1] +
+           (v - c->meas_V[i - 1]) * (c->cmd_V[i] - c->cmd_V[i - 1]) / dy;
+}
+
+static void build_ao_tables(int ch, const AoCal *c)
+{
+    for (int code = 0; code < AO_CODES; ++code) {
+        double v = code_to_voltage((uint16_t)code);
+        g_ao_lut[ch][code] = voltage_to_code(ao_cal_inverse(c, v));
+        g_ao_V[ch][code]   = ao_cal_forward(c, v);
+    }
+}
+
+/*
+ * Загрузка калибровки один раз до t0 в плоские таблицы.
+ * Формат — key=value, как iter_params.txt:
+ *   aoN_gain, aoN_offset_mV      — фактическое = gain*заданное + offset;
+ *   aoN_point=задано_mV:измерено_mV — точки кусочно-линейной характеристики
+ *                                  (по возрастанию; при >= 2 точках
+ *                                  заменяют gain/offset);
+ *   aiN_gain, aiN_offset_mV      — калиброванное = gain*сырое + offset.
+ * Без файла таблицы заполняются идеальным преобразованием.
+ */
+static int load_calibration(const char *path)
+{
+    static AoCal ao[AO_CAL_CHANNELS];
+
+    for (int ch = 0; ch < AO_CAL_CHANNELS; ++ch) {
+        memset(&ao[ch], 0, sizeof(ao[ch]));
+        ao[ch].gain = 1.0;
+    }
+    for (int ch = 0; ch < 8; ++ch) {
+        g_ai_gain[ch] = 1.0f;
+        g_ai_off[ch]  = 0.0f;
+    }
+
+    if (path && path[0] != '\0') {
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            perror("Не удалось открыть файл калибровки");
+            return -1;
+        }
+
+        char line[256];
+        while (fgets(line, sizeof(line), fp)) {
+            strtrim(line);
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+
+            char *eq = strchr(line, '=');
+            if (!eq) continue;
+            *eq = '\0';
+
+            char *key = line;
+            char *val = eq + 1;
+            strtrim(key); strtrim(val);
+
+            int ch = 0;
+            const char *suffix = NULL;
+            if (parse_indexed_key(key, "ao", AO_CAL_CHANNELS, &ch, &suffix)) {
+                AoCal *c = &ao[ch];
+                if (strcmp(suffix, "gain") == 0) {
+                    c->gain = strtod(val, NULL);
+                } else if (strcmp(suffix, "offset_mV") == 0) {
+                    c->offset_V = strtod(val, NULL) / 1000.0;
+                } else if (strcmp(suffix, "point") == 0) {
+                    char *colon = strchr(val, ':');
+                    if (!colon || c->n_points >= CAL_MAX_POINTS)
+                        continue;
+                    c->cmd_V[c->n_points]  = strtod(val, NULL) / 1000.0;
+                    c->meas_V[c->n_points] = strtod(colon + 1, NULL) / 1000.0;
+                    if (c->n_points > 0 &&
+                        (c->cmd_V[c->n_points]  <= c->cmd_V[c->n_points - 1] ||
+                         c->meas_V[c->n_points] <= c->meas_V[c->n_points - 1])) {
+                        fprintf(stderr, "Ошибка калибровки: точки ao%d должны возрастать\n", ch);
+                        fclose(fp);
+                        return -1;
+                    }
+                    c->n_points++;
+                }
+            } else if (parse_indexed_key(key, "ai", 8, &ch, &suffix)) {
+                if (strcmp(suffix, "gain") == 0)
+                    g_ai_gain[ch] = (float)strtod(val, NULL);
+                else if (strcmp(suffix, "offset_mV") == 0)
+                    g_ai_off[ch] = (float)(strtod(val, NULL) / 1000.0);
+            }
+        }
+        fclose(fp);
+    }
+
+    for (int ch = 0; ch < AO_CAL_CHANNELS; ++ch) {
+        if (ao[ch].n_points < 2 && ao[ch].gain == 0.0) {
+            fprintf(stderr, "Ошибка калибровки: ao%d_gain=0\n", ch);
+            return -1;
+        }
+        build_ao_tables(ch, &ao[ch]);
+    }
+
+    return 0;
+}
+
+/* Калибровка AI: один векторизуемый проход по 8 каналам */
+static void ai_apply_calibration(const float *raw, float *out)
+{
+    for (int ch = 0; ch < 8; ++ch)
+        out[ch] = raw[ch] * g_ai_gain[ch] + g_ai_off[ch];
+}
+
+static void close_ao_devices(AoDevice *devs, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        if (devs[i].ctx) {
+            modbus_close(devs[i].ctx);
+            modbus_free(devs[i].ctx);
+            devs[i].ctx = NULL;
+        }
+    }
+}
+
+/* Открытие соединения Modbus/TCP; label — имя модуля для сообщений */
+static modbus_t *open_modbus_tcp(const char *ip, int port, int slave,
+                                 const char *label)
+{
+    modbus_t *ctx = modbus_new_tcp(ip, port);
+    if (!ctx) {
+        fprintf(stderr, "Ошибка modbus_new_tcp (%s %s)\n", label, ip);
+        return NULL;
+    }
+
+    if (modbus_set_slave(ctx, slave) == -1) {
+        fprintf(stderr, "Ошибка modbus_set_slave (%s)\n", label);
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Ошибка modbus_connect (%s %s:%d): %s\n",
+                label, ip, port, modbus_strerror(errno));
+        modbus_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void set_nonblocking(int sock)
+{
+    int fl = fcntl(sock, F_GETFL, 0);
+    if (fl != -1)
+        fcntl(sock, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* Таймаут ответа и межбайтовый таймаут libmodbus, мкс (не меньше 100) */
+static void set_modbus_timeout_us(modbus_t *ctx, long us)
+{
+    if (us < 100)
+        us = 100;
+    modbus_set_response_timeout(ctx, (uint32_t)(us / 1000000), (uint32_t)(us % 1000000));
+    modbus_set_byte_timeout(ctx, (uint32_t)(us / 1000000), (uint32_t)(us % 1000000));
+}
+
+static int connect_ao_devices(const IterParams *p, AoDevice *devs)
+{
+    for (int i = 0; i < p->num_devices; ++i) {
+        const AoDeviceCfg *cfg = &p->devices[i];
+        char label[16];
+        snprintf(label, sizeof(label), "dev%d", i);
+        memset(&devs[i], 0, sizeof(devs[i]));
+
+        modbus_t *ctx = open_modbus_tcp(cfg->ip, cfg->port, cfg->slave, label);
+        if (!ctx) {
+            close_ao_devices(devs, i);
+            return -1;
+        }
+
+        devs[i].ctx  = ctx;
+        devs[i].sock = modbus_get_socket(ctx);
+
+        /* При нескольких модулях сокеты неблокирующие: ответы собираются poll() */
+        if (p->num_devices > 1)
+            set_nonblocking(devs[i].sock);
+    }
+    return 0;
+}
+
+static void close_remote_ai(RemoteAi *rai, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        if (rai[i].ctx) {
+            modbus_close(rai[i].ctx);
+            modbus_free(rai[i].ctx);
+            rai[i].ctx = NULL;
+        }
+    }
+}
+
+static int connect_remote_ai(const IterParams *p, RemoteAi *rai)
+{
+    for (int i = 0; i < p->num_rai; ++i) {
+        const RemoteAiCfg *cfg = &p->rai[i];
+        char label[16];
+        snprintf(label, sizeof(label), "rai%d", i);
+        memset(&rai[i], 0, sizeof(rai[i]));
+
+        rai[i].ctx = open_modbus_tcp(cfg->ip, cfg->port, cfg->slave, label);
+        if (!rai[i].ctx) {
+            close_remote_ai(rai, i);
+            return -1;
+        }
+        rai[i].sock = modbus_get_socket(rai[i].ctx);
+        set_nonblocking(rai[i].sock);
+    }
+    return 0;
+}
+
+/* Отправка запросов чтения входных регистров всем удалённым AI без ожидания */
+static void remote_ai_error(RemoteAi *rai, int i)
+{
+    rai[i].errors++;
+    trace_now(TR_RAI_ERR, i);
+    if (g_met)
+        met_add(&g_met->rai_errors, 1);
+}
+
+static void remote_ai_request(const IterParams *p, RemoteAi *rai)
+{
+    for (int i = 0; i < p->num_rai; ++i) {
+        const RemoteAiCfg *cfg = &p->rai[i];
+        RemoteAi *r = &rai[i];
+
+        /* запоздавший ответ прошлого шага не должен попасть в этот */
+        if (r->stale) {
+            modbus_flush(r->ctx);
+            r->stale = 0;
+        }
+
+        /* кадр с MBAP собирается здесь: TID нужен для сверки с ответом */
+        r->tid++;
+        uint8_t req[12] = {
+            (uint8_t)(r->tid >> 8), (uint8_t)(r->tid & 0xFF), 0, 0, 0, 6,
+            (uint8_t)cfg->slave, 0x04,
+            (uint8_t)(cfg->reg >> 8), (uint8_t)(cfg->reg & 0xFF),
+            0, (uint8_t)cfg->count
+        };
+        clock_gettime(CLOCK_MONOTONIC, &r->t_req);
+        if (send(r->sock, req, sizeof(req), MSG_NOSIGNAL) != (ssize_t)sizeof(req)) {
+            remote_ai_error(rai, i);
+            r->pending = 0;
+            r->stale = 1;
+            continue;
+        }
+        r->pending = 1;
+    }
+}
+
+/*
+ * Сбор ответов удалённых AI до deadline (конец окна измерения).
+ * Не успевший или ошибочный источник сохраняет предыдущие значения.
+ */
+static void remote_ai_collect(const IterParams *p, RemoteAi *rai,
+                              const struct timespec *deadline,
+                              const struct timespec *t0)
+{
+    for (;;) {
+        struct pollfd pfd[MAX_REMOTE_AI];
+        int map[MAX_REMOTE_AI];
+        int np = 0;
+        for (int i = 0; i < p->num_rai; ++i) {
+            if (!rai[i].pending)
+                continue;
+            pfd[np].fd = rai[i].sock;
+            pfd[np].events = POLLIN;
+            pfd[np].revents = 0;
+            map[np++] = i;
+        }
+        if (np == 0)
+            return;
+
+        struct timespec t_now;
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+        long left_us = timespec_diff_us(deadline, &t_now);
+        /* после дедлайна — только уже пришедшие ответы (poll без ожидания) */
+        int rc = poll(pfd, (nfds_t)np, left_us > 0 ? (int)((left_us + 999) / 1000) : 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            for (int k = 0; k < np; ++k) {
+                rai[map[k]].pending = 0;
+                rai[map[k]].stale = 1;
+                remote_ai_error(rai, map[k]);
+            }
+            return;
+        }
+
+        for (int k = 0; k < np; ++k) {
+            if (!(pfd[k].revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+            int i = map[k];
+            const RemoteAiCfg *cfg = &p->rai[i];
+            RemoteAi *r = &rai[i];
+            uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+            /* хвост неполного кадра ждём не дольше, чем осталось до дедлайна */
+            set_modbus_timeout_us(r->ctx, left_us);
+            int len = modbus_receive_confirmation(r->ctx, rsp);
+            struct timespec t_rsp;
+            clock_gettime(CLOCK_MONOTONIC, &t_rsp);
+
+            /* ответ на прежний запрос (после сброса сокета) — отбросить, ждать свой */
+            if (len >= 2 && (uint16_t)((rsp[0] << 8) | rsp[1]) != r->tid)
+                continue;
+            r->pending = 0;
+
+            if (len < 9 + 2 * cfg->count || rsp[7] != 0x04 ||
+                rsp[8] != 2 * cfg->count) {
+                r->stale = 1;
+                remote_ai_error(rai, i);
+                continue;
+            }
+            for (int ch = 0; ch < cfg->count; ++ch) {
+                uint16_t raw = (uint16_t)((rsp[9 + 2 * ch] << 8) | rsp[10 + 2 * ch]);
+                double x = cfg->is_signed ? (double)(int16_t)raw : (double)raw;
+                r->val[ch] = (float)(cfg->gain * x + cfg->offset);
+            }
+            r->t_ms = (double)(timespec_diff_us(&r->t_req, t0) +
+                               timespec_diff_us(&t_rsp, &r->t_req) / 2) * 0.001;
+        }
+    }
+}
+
+/*
+ * Запись кода шага во все модули AO. Запросы отправляются подряд,
+ * не дожидаясь ответов; подтверждения собираются по мере прихода,
+ * поэтому перекос между модулями ограничен одним RTT, а не суммой.
+ * Перекос — разброс оценок момента применения (отправка + RTT/2).
+ */
+static int ao_write_all(const IterParams *p, AoDevice *devs,
+                        const uint16_t *codes, long *skew_us)
+{
+    int n = p->num_devices;
+    *skew_us = 0;
+
+    /* опоздавший ответ ao_verify не должен попасть в подтверждение записи */
+    for (int i = 0; i < n; ++i) {
+        if (devs[i].stale) {
+            modbus_flush(devs[i].ctx);
+            devs[i].stale = 0;
+        }
+    }
+
+    if (n == 1) {
+        struct timespec t_done;
+        clock_gettime(CLOCK_MONOTONIC, &devs[0].t_sent);
+        if (modbus_write_register(devs[0].ctx, p->devices[0].reg, codes[0]) == -1) {
+            fprintf(stderr, "Ошибка modbus_write_register: %s\n",
+                    modbus_strerror(errno));
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t_done);
+        devs[0].lat_us = timespec_diff_us(&t_done, &devs[0].t_sent);
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        const AoDeviceCfg *cfg = &p->devices[i];
+        uint8_t req[6] = {
+            (uint8_t)cfg->slave, 0x06,
+            (uint8_t)(cfg->reg >> 8), (uint8_t)(cfg->reg & 0xFF),
+            (uint8_t)(codes[i] >> 8), (uint8_t)(codes[i] & 0xFF)
+        };
+        clock_gettime(CLOCK_MONOTONIC, &devs[i].t_sent);
+        if (modbus_send_raw_request(devs[i].ctx, req, sizeof(req)) == -1) {
+            fprintf(stderr, "Ошибка отправки записи AO (dev%d): %s\n",
+                    i, modbus_strerror(errno));
+            return -1;
+        }
+        devs[i].pending = 1;
+    }
+
+    int left = n;
+    while (left > 0) {
+        struct pollfd pfd[MAX_AO_DEVICES];
+        int map[MAX_AO_DEVICES];
+        int np = 0;
+        for (int i = 0; i < n; ++i) {
+            if (!devs[i].pending)
+                continue;
+            pfd[np].fd = devs[i].sock;
+            pfd[np].events = POLLIN;
+            pfd[np].revents = 0;
+            map[np++] = i;
+        }
+
+        int rc = poll(pfd, (nfds_t)np, DEV_RESPONSE_TIMEOUT_MS);
+        if (rc <= 0) {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "Ошибка записи AO: нет ответа от %d модул(я/ей)\n", left);
+            return -1;
+        }
+
+        for (int k = 0; k < np; ++k) {
+            if (!(pfd[k].revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+            int i = map[k];
+            uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+            int len = modbus_receive_confirmation(devs[i].ctx, rsp);
+            struct timespec t_done;
+            clock_gettime(CLOCK_MONOTONIC, &t_done);
+            if (len < 8 || rsp[7] != 0x06) {
+                fprintf(stderr, "Ошибка подтверждения записи AO (dev%d): %s\n",
+                        i, len < 0 ? modbus_strerror(errno) : "исключение Modbus");
+                return -1;
+            }
+            devs[i].lat_us = timespec_diff_us(&t_done, &devs[i].t_sent);
+            devs[i].pending = 0;
+            --left;
+        }
+    }
+
+    /* момент применения ≈ отправка + половина RTT, относительно dev0 */
+    long lo = 0, hi = 0;
+    for (int i = 0; i < n; ++i) {
+        long apply = timespec_diff_us(&devs[i].t_sent, &devs[0].t_sent) +
+                     devs[i].lat_us / 2;
+        if (i == 0 || apply < lo) lo = apply;
+        if (i == 0 || apply > hi) hi = apply;
+    }
+    *skew_us = hi - lo;
+    return 0;
+}
+
+/*
+ * Проверка AO чтением регистра: код в каждом модуле сравнивается
+ * с записанным на этом шаге. Выполняется не на каждом шаге, а в запасе
+ * времени после чтения AI, поэтому трафик Modbus почти не растёт.
+ * Расхождение пишется строкой
+ *   #ao_mismatch;cycle;phase;idx;dev;code_set;code_read
+ * Таймаут ответа — оставшееся до t_deadline время (не 500 мс по умолчанию),
+ * не дождались — AO_VERIFY_ERROR.
+ * Возвращает худший по модулям результат AO_VERIFY_*.
+ */
+static int ao_verify(const IterParams *p, AoDevice *devs, const uint16_t *codes,
+                     const struct timespec *t_deadline,
+                     FILE *f, long cycle, int phase, long idx)
+{
+    int res = AO_VERIFY_OK;
+    for (int i = 0; i < p->num_devices; ++i) {
+        struct timespec t_now;
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+        long left_us = timespec_diff_us(t_deadline, &t_now);
+        if (left_us <= 0) {
+            res = AO_VERIFY_ERROR;
+            continue;
+        }
+
+        uint16_t code_read = 0;
+        set_modbus_timeout_us(devs[i].ctx, left_us);
+        int rc = modbus_read_registers(devs[i].ctx, p->devices[i].reg, 1, &code_read);
+        set_modbus_timeout_us(devs[i].ctx, DEV_RESPONSE_TIMEOUT_MS * 1000L);
+        if (rc != 1) {
+            if (errno == ETIMEDOUT)
+                devs[i].stale = 1;
+            res = AO_VERIFY_ERROR;
+            continue;
+        }
+        if (code_read != codes[i]) {
+            log_comment(f, "#ao_mismatch;%ld;%d;%ld;%d;%u;%u\n", cycle, phase, idx, i,
+                        (unsigned int)codes[i], (unsigned int)code_read);
+            if (res == AO_VERIFY_OK)
+                res = AO_VERIFY_MISMATCH;
+        }
+    }
+    return res;
+}
+
+static void release_phase_seqs(PhaseSeq *seqs, int num_phases)
+{
+    for (int i = 0; i < num_phases; ++i) {
+        if (seqs[i].map)
+            munmap(seqs[i].map, seqs[i].map_len);
+        seqs[i].map = NULL;
+    }
+}
+
+
+/* FNV-1a 64 содержимого файла; 0 — файл не прочитан */
+static uint64_t hash_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+
+    uint64_t h = 1469598103934665603ULL;
+    unsigned char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            h ^= buf[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    fclose(fp);
+    return h;
+}
+
+/* Атомарная запись: временный файл, fsync, rename */
+static int save_checkpoint(const Checkpoint *ck)
+{
+    char tmp[sizeof(ITER_CHECKPOINT_FILE) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ITER_CHECKPOINT_FILE);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("Ошибка записи контрольной точки");
+        return -1;
+    }
+    fprintf(fp,
+            "params_hash=0x%016" PRIx64 "\n"
+            "cycle=%ld\n"
+            "phase=%d\n"
+            "idx=%ld\n"
+            "microsteps=%ld\n"
+            "log_file=%s\n"
+            "log_offset=%jd\n",
+            ck->params_hash, ck->cycle, ck->phase, ck->idx,
+            ck->microsteps, ck->log_file, (intmax_t)ck->log_offset);
+    fflush(fp);
+    int err = fsync(fileno(fp)) != 0;
+    err |= fclose(fp) != 0;
+    if (err || rename(tmp, ITER_CHECKPOINT_FILE) != 0) {
+        perror("Ошибка записи контрольной точки");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_checkpoint(Checkpoint *ck)
+{
+    FILE *fp = fopen(ITER_CHECKPOINT_FILE, "r");
+    if (!fp) {
+        perror("Не удалось открыть контрольную точку");
+        return -1;
+    }
+
+    memset(ck, 0, sizeof(*ck));
+    ck->log_offset = -1;
+
+    char line[320];
+    while (fgets(line, sizeof(line), fp)) {
+        strtrim(line);
+        char *eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        const char *key = line;
+        const char *val = eq + 1;
+
+        if (strcmp(key, "params_hash") == 0)     ck->params_hash = strtoull(val, NULL, 0);
+        else if (strcmp(key, "cycle") == 0)      ck->cycle = atol(val);
+        else if (strcmp(key, "phase") == 0)      ck->phase = atoi(val);
+        else if (strcmp(key, "idx") == 0)        ck->idx = atol(val);
+        else if (strcmp(key, "microsteps") == 0) ck->microsteps = atol(val);
+        else if (strcmp(key, "log_file") == 0)
+            snprintf(ck->log_file, sizeof(ck->log_file), "%s", val);
+        else if (strcmp(key, "log_offset") == 0) ck->log_offset = (off_t)strtoll(val, NULL, 10);
+    }
+    fclose(fp);
+
+    if (ck->log_file[0] == '\0' || ck->log_offset < 0) {
+        fprintf(stderr, "Ошибка: контрольная точка повреждена\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Проверка контрольной точки на соответствие текущим параметрам */
+static int validate_checkpoint(const Checkpoint *ck, const IterParams *p,
+                               const PhaseSeq *seqs, uint64_t params_hash)
+{
+    if (ck->params_hash != params_hash) {
+        fprintf(stderr, "Ошибка --resume: iter_params.txt изменился после контрольной точки\n");
+        return -1;
+    }
+    if (ck->phase < 0 || ck->phase >= p->num_phases ||
+        ck->idx < 0 || ck->idx >= seqs[ck->phase].n_steps ||
+        ck->cycle < 0 || (p->repeats > 0 && ck->cycle >= p->repeats)) {
+        fprintf(stderr, "Ошибка --resume: позиция контрольной точки вне профиля\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Усреднение по циклам: на каждую точку (фаза, шаг) — счётчик и
+ * Уэлфорд (среднее, сумма квадратов отклонений) плюс min/max по 8 каналам.
+ * Таблица статическая, смещения фаз считаются по предрасчитанному
+ * числу шагов до t0.
+ */
+typedef struct {
+    uint32_t n;
+    int iter_mV;
+    double mean[8];
+    double m2[8];
+    float min[8];
+    float max[8];
+} AggPoint;
+
+static AggPoint g_agg[MAX_AGG_POINTS];
+static long g_agg_base[MAX_PHASES];
+static long g_agg_points;
+
+static int agg_init(const IterParams *p, const PhaseSeq *seqs)
+{
+    g_agg_points = 0;
+    for (int i = 0; i < p->num_phases; ++i) {
+        g_agg_base[i] = g_agg_points;
+        g_agg_points += seqs[i].n_steps;
+    }
+    if (g_agg_points > MAX_AGG_POINTS) {
+        fprintf(stderr, "Ошибка: aggregate=1 — шагов за цикл %ld, максимум %d\n",
+                g_agg_points, MAX_AGG_POINTS);
+        return -1;
+    }
+    memset(g_agg, 0, sizeof(AggPoint) * (size_t)g_agg_points);
+    return 0;
+}
+
+static void agg_add(AggPoint *a, int iter_mV, const float ai[8])
+{
+    a->iter_mV = iter_mV;
+    if (a->n == 0) {
+        for (int ch = 0; ch < 8; ++ch) {
+            a->mean[ch] = ai[ch];
+            a->min[ch]  = ai[ch];
+            a->max[ch]  = ai[ch];
+        }
+        a->n = 1;
+        return;
+    }
+
+    double inv_n = 1.0 / (double)++a->n;
+    for (int ch = 0; ch < 8; ++ch) {
+        double x = ai[ch];
+        double d = x - a->mean[ch];
+        a->mean[ch] += d * inv_n;
+        a->m2[ch]   += d * (x - a->mean[ch]);
+        if (ai[ch] < a->min[ch]) a->min[ch] = ai[ch];
+        if (ai[ch] > a->max[ch]) a->max[ch] = ai[ch];
+    }
+}
+
+/* Запись через временный файл и rename: читатель видит только целый файл */
+static int agg_dump(const char *path, const IterParams *p, const PhaseSeq *seqs,
+                    long cycles)
+{
+    char tmp[272];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("Ошибка записи усреднённой кривой");
+        return -1;
+    }
+
+    fprintf(fp, "phase;idx;iter_mV;n");
+    for (int ch = 0; ch < 8; ++ch)
+        fprintf(fp, ";AI%d_mean;AI%d_std;AI%d_min;AI%d_max", ch, ch, ch, ch);
+    fputc('\n', fp);
+    fprintf(fp, "#agg;cycles;%ld;points;%ld\n", cycles, g_agg_points);
+
+    for (int ph = 0; ph < p->num_phases; ++ph) {
+        for (long idx = 0; idx < seqs[ph].n_steps; ++idx) {
+            const AggPoint *a = &g_agg[g_agg_base[ph] + idx];
+            if (a->n == 0)
+                continue;
+            fprintf(fp, "%d;%ld;%d;%u", ph + 1, idx, a->iter_mV, (unsigned int)a->n);
+            for (int ch = 0; ch < 8; ++ch) {
+                double sd = a->n > 1 ? sqrt(a->m2[ch] / (double)(a->n - 1)) : 0.0;
+                fprintf(fp, ";%.6f;%.6f;%.6f;%.6f", a->mean[ch], sd,
+                        (double)a->min[ch], (double)a->max[ch]);
+            }
+            fputc('\n', fp);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        perror("Ошибка записи усреднённой кривой");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Прореживание: 1 — строку писать. Первая и последняя строки фазы
+ * пишутся всегда; иначе строка должна попасть на каждый N-й шаг и
+ * (при зоне нечувствительности) хотя бы один канал должен уйти от
+ * последней записанной строки дальше порога.
+ */
+static int log_row_due(const IterParams *p, long idx, long n_steps,
+                       const float ai[8], const float last_ai[8], long skipped)
+{
+    if (idx == 0 || idx == n_steps - 1)
+        return 1;
+    if (p->log_max_skip > 0 && skipped >= p->log_max_skip)
+        return 1;
+    if (idx % p->log_every != 0)
+        return 0;
+    if (!p->deadband_enabled)
+        return 1;
+
+    int moved = 0;
+    for (int ch = 0; ch < 8; ++ch)
+        moved |= p->deadband_V[ch] >= 0.0f && fabsf(ai[ch] - last_ai[ch]) > p->deadband_V[ch];
+    return moved;
+}
+
+/*
+ * Lock-in: суммы I/Q по 8 каналам за блок из целого числа периодов
+ * синуса (постоянная составляющая в блоке сокращается).
+ * Для x = A·sin(ωt + φ): I = N·A/2·cos φ, Q = N·A/2·sin φ.
+ */
+typedef struct {
+    float i[8];
+    float q[8];
+    long n;
+    long block;
+    int64_t t_start_ns;
+} LockIn;
+
+static void lockin_reset(LockIn *lk)
+{
+    memset(lk, 0, sizeof(*lk));
+}
+
+/* Один проход по 8 каналам — два умножения-сложения на канал (NEON) */
+static void lockin_add(LockIn *lk, const float ai[8], float s, float c)
+{
+    for (int ch = 0; ch < 8; ++ch) {
+        lk->i[ch] += ai[ch] * s;
+        lk->q[ch] += ai[ch] * c;
+    }
+    ++lk->n;
+}
+
+static void write_lockin_header(FILE *f)
+{
+    fprintf(f, "cycle;phase;block;t_start_ns;n;freq_Hz");
+    for (int ch = 0; ch < 8; ++ch)
+        fprintf(f, ";AI%d_amp;AI%d_deg", ch, ch);
+    fputc('\n', f);
+}
+
+static void lockin_flush(FILE *f, LockIn *lk, long cycle_num, int phase_num,
+                         double freq_Hz)
+{
+    fprintf(f, "%ld;%d;%ld;%" PRId64 ";%ld;%.6f",
+            cycle_num, phase_num, lk->block, lk->t_start_ns, lk->n, freq_Hz);
+    float k = 2.0f / (float)lk->n;
+    for (int ch = 0; ch < 8; ++ch) {
+        float amp = k * sqrtf(lk->i[ch] * lk->i[ch] + lk->q[ch] * lk->q[ch]);
+        float deg = atan2f(lk->q[ch], lk->i[ch]) * (float)(180.0 / M_PI);
+        fprintf(f, ";%.6f;%.3f", (double)amp, (double)deg);
+    }
+    fputc('\n', f);
+
+    long block = lk->block + 1;
+    lockin_reset(lk);
+    lk->block = block;
+}
+
+/* Файл результатов рядом с логом: <каталог лога><prefix>YYYYMMDD_HHMMSS.csv */
+static void sibling_log_name(char *buf, size_t size, const char *log_path,
+                             const char *prefix, const struct tm *tm)
+{
+    const char *slash = strrchr(log_path, '/');
+    int dir_len = slash ? (int)(slash - log_path) + 1 : 0;
+    snprintf(buf, size, "%.*s%s%04d%02d%02d_%02d%02d%02d.csv",
+             dir_len, log_path, prefix,
+             tm->tm_year + 1900,
+             tm->tm_mon + 1,
+             tm->tm_mday,
+             tm->tm_hour,
+             tm->tm_min,
+             tm->tm_sec);
+}
+
+#define CSV_BASE_HEADER \
+    "cycle;phase;idx;time_ms;iter_mV;iter_V;code_set;ao_V;" \
+    "AI0;AI1;AI2;AI3;AI4;AI5;AI6;AI7;" \
+    "t_set_ns;ao_done_ns;ai_start_ns;ai_end_ns"
+
+/*
+ * Сжатый лог. Файл: заголовок (магия, версия, шаг квантования,
+ * таблица «код -> ao_V», строка заголовка CSV), затем блоки:
+ *   'B', u32 длина данных, u32 строк, i64 t0_ns, данные.
+ * В начале блока состояние кодера обнуляется, поэтому каждый блок
+ * декодируется независимо. Строка шага — тег и zig-zag varint:
+ *   [cycle, phase, idx — при смене позиции] [шаг сетки, нс — при смене]
+ *   t_set − (t_set пред. + шаг сетки), ao_done/ai_start − t_set,
+ *   ai_end − ai_start, вторые разности iter_mV и code_set,
+ *   разности квантованных AI0…AI7.
+ * Блок копится в статическом буфере и пишется одним fwrite.
+ */
+typedef struct {
+    int active;
+    FILE *f;
+    long block_rows;
+    double inv_quant;         /* 1 / шаг квантования, 1/В */
+    int64_t t0_ns;
+
+    uint8_t buf[PK_BUF_SIZE];
+    size_t len;
+    long rows;
+
+    long cycle, idx;
+    int phase;
+    int64_t grid_ns, t_set_ns;
+    int32_t mV, mV_d, code, code_d;
+    int32_t q[8];
+} PackedLog;
+
+static PackedLog g_pk;
+
+static void pk_put_u32(uint8_t *b, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        b[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void pk_put_u64(uint8_t *b, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        b[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void pk_uvar(uint64_t v)
+{
+    uint8_t *b = g_pk.buf + g_pk.len;
+    while (v >= 0x80) {
+        *b++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *b++ = (uint8_t)v;
+    g_pk.len = (size_t)(b - g_pk.buf);
+}
+
+static void pk_svar(int64_t v)
+{
+    pk_uvar(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void pk_reset_state(void)
+{
+    g_pk.len = 0;
+    g_pk.rows = 0;
+    g_pk.cycle = -1;
+    g_pk.phase = -1;
+    g_pk.idx = -1;
+    g_pk.grid_ns = 0;
+    g_pk.t_set_ns = 0;
+    g_pk.mV = g_pk.mV_d = 0;
+    g_pk.code = g_pk.code_d = 0;
+    memset(g_pk.q, 0, sizeof(g_pk.q));
+}
+
+/* Запись накопленного блока; вызывается раз в log_block_rows строк и на границах */
+static void pk_flush(void)
+{
+    if (!g_pk.active || g_pk.len == 0)
+        return;
+    uint8_t hdr[17];
+    hdr[0] = 'B';
+    pk_put_u32(hdr + 1, (uint32_t)g_pk.len);
+    pk_put_u32(hdr + 5, (uint32_t)g_pk.rows);
+    pk_put_u64(hdr + 9, (uint64_t)g_pk.t0_ns);
+    fwrite(hdr, 1, sizeof(hdr), g_pk.f);
+    fwrite(g_pk.buf, 1, g_pk.len, g_pk.f);
+    pk_reset_state();
+}
+
+static void pk_reserve(size_t need)
+{
+    if (g_pk.len + need > sizeof(g_pk.buf))
+        pk_flush();
+}
+
+static void pk_text(const char *line)
+{
+    size_t n = strlen(line);
+    if (n > PK_TEXT_MAX)
+        n = PK_TEXT_MAX;
+    pk_reserve(n + 12);
+    g_pk.buf[g_pk.len++] = PK_TAG_TEXT;
+    pk_uvar(n);
+    memcpy(g_pk.buf + g_pk.len, line, n);
+    g_pk.len += n;
+}
+
+/* Строка шага: фиксированное число полей — ограниченное время на шаг */
+static void pk_row(long cycle, int phase, long idx, long period_us,
+                   int iter_mV, uint16_t code,
+                   int64_t t_set_ns, int64_t ao_done_ns,
+                   int64_t ai_start_ns, int64_t ai_end_ns, const float ai[8])
+{
+    pk_reserve(PK_ROW_MAX);
+
+    int64_t grid_ns = (int64_t)period_us * 1000;
+    uint8_t tag = 0;
+    if (cycle != g_pk.cycle || phase != g_pk.phase || idx != g_pk.idx + 1)
+        tag |= PK_TAG_POS;
+    if (grid_ns != g_pk.grid_ns)
+        tag |= PK_TAG_GRID;
+    g_pk.buf[g_pk.len++] = tag;
+    if (tag & PK_TAG_POS) {
+        pk_uvar((uint64_t)cycle);
+        pk_uvar((uint64_t)phase);
+        pk_uvar((uint64_t)idx);
+    }
+    if (tag & PK_TAG_GRID)
+        pk_uvar((uint64_t)grid_ns);
+
+    pk_svar(t_set_ns - (g_pk.t_set_ns + grid_ns));
+    pk_svar(ao_done_ns - t_set_ns);
+    pk_svar(ai_start_ns - t_set_ns);
+    pk_svar(ai_end_ns - ai_start_ns);
+
+    int32_t d = iter_mV - g_pk.mV;
+    pk_svar(d - g_pk.mV_d);
+    g_pk.mV_d = d;
+    d = (int32_t)code - g_pk.code;
+    pk_svar(d - g_pk.code_d);
+    g_pk.code_d = d;
+
+    for (int ch = 0; ch < 8; ++ch) {
+        /* за пределами PK_AI_RANGE_V — насыщение, а не переполнение */
+        double x = (double)ai[ch] * g_pk.inv_quant;
+        int32_t q = x >= (double)INT32_MAX ? INT32_MAX :
+                    x > (double)INT32_MIN ? (int32_t)lrint(x) : INT32_MIN;
+        pk_svar((int64_t)q - g_pk.q[ch]);
+        g_pk.q[ch] = q;
+    }
+
+    g_pk.cycle = cycle;
+    g_pk.phase = phase;
+    g_pk.idx = idx;
+    g_pk.grid_ns = grid_ns;
+    g_pk.t_set_ns = t_set_ns;
+    g_pk.mV = iter_mV;
+    g_pk.code = code;
+
+    if (++g_pk.rows >= g_pk.block_rows)
+        pk_flush();
+}
+
+/* Заголовок файла: всё, что нужно декодеру для вывода стандартного CSV */
+static void pk_write_file_header(FILE *f, const IterParams *p)
+{
+    uint8_t b[12];
+    static const char hdr_line[] = CSV_BASE_HEADER "\n";
+
+    fwrite(PK_MAGIC, 1, 8, f);
+    pk_put_u32(b, PK_VERSION);
+    pk_put_u32(b + 4, (uint32_t)p->log_quant_nV);
+    pk_put_u32(b + 8, AO_CODES);
+    fwrite(b, 1, 12, f);
+    fwrite(g_ao_V[0], sizeof(double), AO_CODES, f);   /* ao_V по коду, LE */
+    pk_put_u32(b, (uint32_t)(sizeof(hdr_line) - 1));
+    fwrite(b, 1, 4, f);
+    fwrite(hdr_line, 1, sizeof(hdr_line) - 1, f);
+}
+
+static void pk_open(FILE *f, const IterParams *p, int64_t t0_ns)
+{
+    g_pk.active = 1;
+    g_pk.f = f;
+    g_pk.block_rows = p->log_block_rows;
+    g_pk.inv_quant = 1.0e9 / (double)p->log_quant_nV;
+    g_pk.t0_ns = t0_ns;
+    pk_reset_state();
+}
+
+/* Строки '#': в CSV — как есть, в сжатом логе — текстовой записью блока */
+static void log_comment(FILE *f, const char *fmt, ...)
+{
+    char line[PK_TEXT_MAX + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (g_pk.active)
+        pk_text(line);
+    else
+        fputs(line, f);
+}
+
+static void write_csv_header(FILE *f, const IterParams *p)
+{
+    if (p->log_packed) {
+        pk_write_file_header(f, p);
+        return;
+    }
+    fprintf(f, CSV_BASE_HEADER);
+    if (p->settle_adaptive)
+        fprintf(f, ";settle_us");
+    if (p->pid_enabled)
+        fprintf(f, ";pid_y;pid_err;pid_p;pid_i;pid_d;pid_u;late_us;write_us");
+    if (p->num_devices > 1) {
+        for (int i = 0; i < p->num_devices; ++i)
+            fprintf(f, ";dev%d_code;dev%d_lat_us", i, i);
+        fprintf(f, ";dev_skew_us");
+    }
+    for (int i = 0; i < p->num_rai; ++i) {
+        fprintf(f, ";rai%d_t_ms", i);
+        for (int ch = 0; ch < p->rai[i].count; ++ch)
+            fprintf(f, ";RAI%d_%d", i, ch);
+    }
+    if (p->sync_do >= 0)
+        fprintf(f, ";do_done_ns;do_us");
+    if (p->log_every > 1 || p->deadband_enabled)
+        fprintf(f, ";skipped");
+    if (p->ao_verify_every > 0 || p->ao_verify_slack_us > 0)
+        fprintf(f, ";ao_verify");
+    if (p->ai_stagger) {
+        for (int ch = 0; ch < 8; ++ch)
+            fprintf(f, ";AI%d_t_ns", ch);
+    }
+    fputc('\n', f);
+}
+
+/*
+ * Сторож AO. Общая с процессом-сторожем страница памяти: цикл пишет
+ * туда только крайний срок следующего «здорового» шага (одна запись
+ * в память, без ввода-вывода). Сторож — отдельный однопоточный процесс,
+ * чтобы сработать и при гибели основного (SIGKILL, сбой).
+ */
+typedef struct {
+    int64_t deadline_ns;      /* 0 — ещё не взведён */
+    int done;                 /* штатное завершение — сторож уходит молча */
+} WdtShared;
+
+static WdtShared *g_wdt;
+static pid_t      g_wdt_pid = -1;
+static int        g_wdt_pipe = -1;    /* EOF в сторож — основной процесс умер */
+static int64_t    g_wdt_next_feed_ns;
+
+static void wdt_safe_output(const IterParams *p, const char *reason)
+{
+    fprintf(stderr, "WATCHDOG: %s — AO -> безопасный код %d\n",
+            reason, p->wdt_safe_code);
+    for (int i = 0; i < p->num_devices; ++i) {
+        const AoDeviceCfg *cfg = &p->devices[i];
+        modbus_t *ctx = open_modbus_tcp(cfg->ip, cfg->port, cfg->slave, "watchdog");
+        if (!ctx)
+            continue;
+        if (modbus_write_register(ctx, cfg->reg, (uint16_t)p->wdt_safe_code) == -1)
+            fprintf(stderr, "WATCHDOG: ошибка записи dev%d: %s\n",
+                    i, modbus_strerror(errno));
+        modbus_close(ctx);
+        modbus_free(ctx);
+    }
+}
+
+static void wdt_guardian(const IterParams *p, int pipe_rd)
+{
+    int check_ms = (int)(p->wdt_timeout_ms / 4);
+    if (check_ms < 5)
+        check_ms = 5;
+    int latched = 0;
+
+    for (;;) {
+        struct pollfd pfd = { pipe_rd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, check_ms);
+
+        if (__atomic_load_n(&g_wdt->done, __ATOMIC_ACQUIRE))
+            _exit(0);
+
+        if (rc > 0) {
+            char b;
+            if (read(pipe_rd, &b, 1) <= 0) {
+                if (!__atomic_load_n(&g_wdt->done, __ATOMIC_ACQUIRE))
+                    wdt_safe_output(p, "основной процесс завершился аварийно");
+                _exit(0);
+            }
+        }
+
+        int64_t dl = __atomic_load_n(&g_wdt->deadline_ns, __ATOMIC_RELAXED);
+        if (dl == 0)
+            continue;
+
+        struct timespec t_now;
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+        int64_t now = timespec_to_ns(&t_now);
+        if (now > dl && !latched) {
+            wdt_safe_output(p, "цикл шагов остановился");
+            latched = 1;
+        } else if (now <= dl && latched) {
+            fprintf(stderr, "WATCHDOG: цикл шагов восстановился\n");
+            latched = 0;
+        }
+    }
+}
+
+static int watchdog_start(const IterParams *p)
+{
+    g_wdt = mmap(NULL, sizeof(WdtShared), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_wdt == MAP_FAILED) {
+        perror("Ошибка mmap сторожа");
+        g_wdt = NULL;
+        return -1;
+    }
+    memset(g_wdt, 0, sizeof(*g_wdt));
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("Ошибка pipe сторожа");
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Ошибка fork сторожа");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        /* Ctrl+C адресован основному процессу: он завершится штатно */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        close(fds[1]);
+        wdt_guardian(p, fds[0]);
+        _exit(0);
+    }
+
+    close(fds[0]);
+    g_wdt_pipe = fds[1];
+    g_wdt_pid  = pid;
+    return 0;
+}
+
+/* Шаг выполнен в срок: следующий должен начаться не позже чем через period + timeout */
+static void watchdog_feed(const IterParams *p, int64_t now_ns, long period_us)
+{
+    __atomic_store_n(&g_wdt->deadline_ns,
+                     now_ns + (int64_t)period_us * 1000 +
+                     (int64_t)p->wdt_timeout_ms * 1000000,
+                     __ATOMIC_RELAXED);
+}
+
+/* Плановая пауза между фазами не считается остановкой */
+static void watchdog_extend(int pause_ms)
+{
+    if (g_wdt && pause_ms > 0)
+        __atomic_add_fetch(&g_wdt->deadline_ns, (int64_t)pause_ms * 1000000,
+                           __ATOMIC_RELAXED);
+}
+
+/* Подкормка таймера модуля — не чаще wdt_feed_ms, вне окна шага */
+static void watchdog_feed_module(const IterParams *p, int fd_io, int64_t now_ns)
+{
+    if (p->wdt_module_timeout <= 0 || now_ns < g_wdt_next_feed_ns)
+        return;
+    SetWDTTimeout(fd_io, p->wdt_module_timeout);
+    g_wdt_next_feed_ns = now_ns + (int64_t)p->wdt_feed_ms * 1000000;
+}
+
+/* Ожидание внешнего триггера — не остановка цикла */
+static void watchdog_suspend(void)
+{
+    if (g_wdt)
+        __atomic_store_n(&g_wdt->deadline_ns, 0, __ATOMIC_RELAXED);
+}
+
+static void watchdog_stop(void)
+{
+    if (!g_wdt)
+        return;
+    __atomic_store_n(&g_wdt->done, 1, __ATOMIC_RELEASE);
+    if (g_wdt_pipe >= 0)
+        close(g_wdt_pipe);
+    if (g_wdt_pid > 0)
+        waitpid(g_wdt_pid, NULL, 0);
+    munmap(g_wdt, sizeof(WdtShared));
+    g_wdt = NULL;
+}
+
+/* HTTP-сервер метрик: отдельный процесс, цикл шагов его не ждёт */
+static pid_t g_met_pid = -1;
+static int   g_met_pipe = -1;     /* EOF — основной процесс завершился */
+
+static size_t met_printf(char *buf, size_t size, size_t pos, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static size_t met_printf(char *buf, size_t size, size_t pos, const char *fmt, ...)
+{
+    if (pos >= size)
+        return pos;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + pos, size - pos, fmt, ap);
+    va_end(ap);
+    return n > 0 ? pos + (size_t)n : pos;
+}
+
+static size_t met_counter(char *buf, size_t size, size_t pos, const char *name,
+                          const char *help, const uint64_t *c)
+{
+    return met_printf(buf, size, pos, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+                      name, help, name, name, __atomic_load_n(c, __ATOMIC_RELAXED));
+}
+
+static size_t met_gauge(char *buf, size_t size, size_t pos, const char *name,
+                        const char *help, const int64_t *g)
+{
+    return met_printf(buf, size, pos, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRId64 "\n",
+                      name, help, name, name, __atomic_load_n(g, __ATOMIC_RELAXED));
+}
+
+static size_t met_histogram(char *buf, size_t size, size_t pos, const char *name,
+                            const char *help, const MetHist *h)
+{
+    uint64_t cum = 0;
+    pos = met_printf(buf, size, pos, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int b = 0; b < MET_BUCKETS; ++b) {
+        cum += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+        if (b < MET_BUCKETS - 1)
+            pos = met_printf(buf, size, pos, "%s_bucket{le=\"%ld\"} %" PRIu64 "\n",
+                             name, k_met_le_us[b], cum);
+        else
+            pos = met_printf(buf, size, pos, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+                             name, cum);
+    }
+    return met_printf(buf, size, pos, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n",
+                      name, __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED), name, cum);
+}
+
+static size_t metrics_format(char *buf, size_t size)
+{
+    const Metrics *m = g_met;
+    size_t pos = 0;
+    pos = met_counter(buf, size, pos, "iter_runs_total", "Начатые прогоны", &m->runs);
+    pos = met_counter(buf, size, pos, "iter_steps_total", "Выполненные шаги", &m->steps);
+    pos = met_counter(buf, size, pos, "iter_deadline_misses_total",
+                      "Шаги с опозданием пробуждения больше wdt_late_us", &m->deadline_misses);
+    pos = met_counter(buf, size, pos, "iter_ai_fallbacks_total",
+                      "Ошибки чтения встроенных AI (взято предыдущее значение)", &m->ai_fallbacks);
+    pos = met_counter(buf, size, pos, "iter_modbus_ao_errors_total",
+                      "Ошибки записи AO по Modbus/TCP", &m->ao_errors);
+    pos = met_counter(buf, size, pos, "iter_ao_verify_mismatches_total",
+                      "Расхождения кода AO при проверке чтением регистра",
+                      &m->ao_verify_mismatches);
+    pos = met_counter(buf, size, pos, "iter_modbus_rai_errors_total",
+                      "Ошибки и таймауты удалённых AI по Modbus/TCP", &m->rai_errors);
+    pos = met_counter(buf, size, pos, "iter_modbus_reconnects_total",
+                      "Переподключения модулей Modbus/TCP после неудачного задания",
+                      &m->modbus_reconnects);
+    pos = met_counter(buf, size, pos, "iter_log_rows_total", "Записанные строки лога", &m->log_rows);
+    pos = met_gauge(buf, size, pos, "iter_running", "1 — идёт прогон", &m->running);
+    pos = met_gauge(buf, size, pos, "iter_cycle", "Текущий цикл", &m->cycle);
+    pos = met_gauge(buf, size, pos, "iter_phase", "Текущая фаза", &m->phase);
+    pos = met_gauge(buf, size, pos, "iter_last_late_microseconds",
+                    "Опоздание пробуждения последнего шага", &m->last_late_us);
+    pos = met_gauge(buf, size, pos, "iter_log_pending_bytes",
+                    "Данные лога в памяти, ещё не переданные в файл", &m->log_pending_bytes);
+    pos = met_histogram(buf, size, pos, "iter_step_late_microseconds",
+                        "Опоздание пробуждения шага", &m->late);
+    pos = met_histogram(buf, size, pos, "iter_ao_write_microseconds",
+                        "Длительность записи AO", &m->ao_write);
+    pos = met_histogram(buf, size, pos, "iter_ai_read_microseconds",
+                        "Длительность чтения 8 встроенных AI", &m->ai_read);
+    return pos < size ? pos : size;
+}
+
+static void metrics_reply(int c)
+{
+    static char req[1024];
+    static char body[16384];
+    static char head[256];
+
+    /* медленный клиент не держит сервер дольше 200 мс */
+    struct timeval tv = { 0, 200000 };
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    size_t got = 0;
+    while (got < sizeof(req) - 1) {
+        ssize_t n = read(c, req + got, sizeof(req) - 1 - got);
+        if (n <= 0)
+            break;
+        got += (size_t)n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    req[got] = '\0';
+
+    int ok = strncmp(req, "GET /metrics", 12) == 0 || strncmp(req, "GET / ", 6) == 0;
+    size_t blen = ok ? metrics_format(body, sizeof(body))
+                     : (size_t)snprintf(body, sizeof(body), "not found\n");
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n",
+                        ok ? "200 OK" : "404 Not Found", blen);
+    if (write(c, head, (size_t)hlen) == hlen)
+        (void)!write(c, body, blen);
+}
+
+static void metrics_serve(int lsock, int pipe_rd)
+{
+    for (;;) {
+        struct pollfd pfd[2] = { { lsock, POLLIN, 0 }, { pipe_rd, POLLIN, 0 } };
+        int rc = poll(pfd, 2, 1000);
+
+        if (__atomic_load_n(&g_met->done, __ATOMIC_ACQUIRE))
+            _exit(0);
+        if (rc <= 0)
+            continue;
+        if (pfd[1].revents) {
+            char b;
+            if (read(pipe_rd, &b, 1) <= 0)
+                _exit(0);
+        }
+        if (pfd[0].revents & POLLIN) {
+            int c = accept(lsock, NULL, NULL);
+            if (c < 0)
+                continue;
+            metrics_reply(c);
+            close(c);
+        }
+    }
+}
+
+static int metrics_start(const IterParams *p)
+{
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)p->metrics_port);
+    if (inet_pton(AF_INET, p->metrics_addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "Ошибка: metrics_addr=%s не IPv4-адрес\n", p->metrics_addr);
+        return -1;
+    }
+
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (lsock < 0 ||
+        setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(lsock, 4) != 0) {
+        perror("Ошибка открытия порта метрик");
+        if (lsock >= 0)
+            close(lsock);
+        return -1;
+    }
+
+    g_met = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_met == MAP_FAILED) {
+        perror("Ошибка mmap метрик");
+        g_met = NULL;
+        close(lsock);
+        return -1;
+    }
+    memset(g_met, 0, sizeof(*g_met));
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("Ошибка pipe метрик");
+        close(lsock);
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Ошибка fork сервера метрик");
+        close(lsock);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        /* канал сторожа держать нельзя: иначе он не заметит гибели основного */
+        if (g_wdt_pipe >= 0)
+            close(g_wdt_pipe);
+        close(fds[1]);
+        (void)!nice(10);
+        metrics_serve(lsock, fds[0]);
+        _exit(0);
+    }
+
+    close(lsock);
+    close(fds[0]);
+    g_met_pipe = fds[1];
+    g_met_pid  = pid;
+    printf("Метрики: http://%s:%d/metrics\n", p->metrics_addr, p->metrics_port);
+    return 0;
+}
+
+static void metrics_stop(void)
+{
+    if (!g_met)
+        return;
+    __atomic_store_n(&g_met->done, 1, __ATOMIC_RELEASE);
+    if (g_met_pipe >= 0)
+        close(g_met_pipe);
+    if (g_met_pid > 0)
+        waitpid(g_met_pid, NULL, 0);
+    munmap(g_met, sizeof(Metrics));
+    g_met = NULL;
+}
+
+/*
+ * Лог в ОЗУ (log_stage_dir на tmpfs). Цикл пишет лог в файл в ОЗУ,
+ * как раньше — обычным FILE*; отдельный процесс с низким приоритетом
+ * (nice 19, ввод-вывод класса idle) переносит его на носитель целыми
+ * кусками log_chunk_kb, делает fdatasync по политике log_fsync
+ * и освобождает перенесённое (FALLOC_FL_PUNCH_HOLE). Перенесённый
+ * и сброшенный объём — в общей странице памяти. При нехватке места
+ * в ОЗУ (log_stage_max_kb) цикл ждёт переноса, как при прямой записи.
+ * При гибели основного процесса перенос всё равно завершается.
+ */
+#define STAGE_POLL_MS     100
+#define STAGE_COPY_BUF    65536
+
+typedef struct {
+    int64_t copied;           /* перенесено на носитель, байт */
+    int64_t synced;           /* из них сброшено fdatasync */
+    int64_t sync_req;         /* цикл ждёт synced >= sync_req */
+    int64_t final_size;       /* размер файла в ОЗУ в конце прогона, -1 — идёт запись */
+    int error;                /* errno последней ошибки записи */
+} StageShared;
+
+static StageShared *g_stage;
+static pid_t   g_stage_pid = -1;
+static int     g_stage_pipe = -1;
+static int64_t g_stage_base;  /* размер лога на носителе до прогона (--resume) */
+static long    g_stage_waits;
+static int     g_stage_exited;  /* процесс переноса уже собран waitpid */
+static int     g_stage_status;
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void stage_flusher(const IterParams *p, const char *stage_path,
+                          int stage_fd, int out_fd, int pipe_rd)
+{
+    static char buf[STAGE_COPY_BUF];
+    const int64_t chunk = (int64_t)p->log_chunk_kb * 1024;
+    int64_t copied = 0, synced = 0, punched = 0;
+    int parent_gone = 0, punch_warned = 0;
+
+    for (;;) {
+        if (!parent_gone) {
+            struct pollfd pfd = { pipe_rd, POLLIN, 0 };
+            if (poll(&pfd, 1, STAGE_POLL_MS) > 0) {
+                char b[64];
+                if (read(pipe_rd, b, sizeof(b)) <= 0)
+                    parent_gone = 1;
+            }
+        }
+
+        int64_t final_size = __atomic_load_n(&g_stage->final_size, __ATOMIC_ACQUIRE);
+        int64_t sync_req = __atomic_load_n(&g_stage->sync_req, __ATOMIC_ACQUIRE);
+        int finishing = parent_gone || final_size >= 0;
+        struct stat st;
+        if (fstat(stage_fd, &st) != 0)
+            _exit(1);
+
+        /* целыми кусками; остаток — по запросу синхронизации и в конце */
+        int64_t want = (int64_t)st.st_size - copied;
+        if (!finishing && sync_req <= copied)
+            want -= want % chunk;
+        while (want > 0) {
+            size_t n = want > (int64_t)sizeof(buf) ? sizeof(buf) : (size_t)want;
+            ssize_t r = pread(stage_fd, buf, n, copied);
+            if (r <= 0)
+                break;
+            if (write_all(out_fd, buf, (size_t)r) != 0) {
+                __atomic_store_n(&g_stage->error, errno, __ATOMIC_RELAXED);
+                if (finishing)
+                    _exit(1);
+                break;
+            }
+            copied += r;
+            want -= r;
+            __atomic_store_n(&g_stage->copied, copied, __ATOMIC_RELEASE);
+            if (p->log_fsync == LOG_FSYNC_CHUNK && copied - synced >= chunk) {
+                fdatasync(out_fd);
+                synced = copied;
+                __atomic_store_n(&g_stage->synced, synced, __ATOMIC_RELEASE);
+            }
+        }
+
+        /* перенесённое больше не занимает ОЗУ */
+        int64_t hole = copied & ~((int64_t)g_page_size - 1);
+        if (hole > punched) {
+            if (fallocate(stage_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          punched, hole - punched) == 0) {
+                punched = hole;
+            } else if (!punch_warned) {
+                fprintf(stderr, "Лог в ОЗУ: освобождение перенесённого не поддерживается (%s)\n",
+                        strerror(errno));
+                punch_warned = 1;
+            }
+        }
+
+        /* контрольная точка требует сброса независимо от log_fsync */
+        if (sync_req > synced && copied >= sync_req) {
+            fdatasync(out_fd);
+            synced = copied;
+            __atomic_store_n(&g_stage->synced, synced, __ATOMIC_RELEASE);
+        }
+
+        if (finishing && copied >= (final_size >= 0 ? final_size : (int64_t)st.st_size)) {
+            if (p->log_fsync != LOG_FSYNC_NONE)
+                fdatasync(out_fd);
+            __atomic_store_n(&g_stage->synced, copied, __ATOMIC_RELEASE);
+            close(out_fd);
+            /* основной процесс погиб — файл в ОЗУ больше некому удалить */
+            if (parent_gone && final_size < 0)
+                unlink(stage_path);
+            _exit(__atomic_load_n(&g_stage->error, __ATOMIC_RELAXED) ? 1 : 0);
+        }
+    }
+}
+
+/* Запуск переноса: stage_path уже создан циклом, final_path — лог на носителе */
+static int stage_start(const IterParams *p, const char *stage_path,
+                       const char *final_path, int64_t resume_offset)
+{
+    int stage_fd = open(stage_path, O_RDWR);
+    int out_fd = resume_offset > 0 ? open(final_path, O_WRONLY)
+                                   : open(final_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stage_fd < 0 || out_fd < 0 ||
+        lseek(out_fd, resume_offset, SEEK_SET) != (off_t)resume_offset) {
+        perror("Ошибка открытия лога для переноса из ОЗУ");
+        if (stage_fd >= 0)
+            close(stage_fd);
+        if (out_fd >= 0)
+            close(out_fd);
+        return -1;
+    }
+
+    g_stage = mmap(NULL, sizeof(StageShared), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_stage == MAP_FAILED) {
+        perror("Ошибка mmap переноса лога");
+        g_stage = NULL;
+        close(stage_fd);
+        close(out_fd);
+        return -1;
+    }
+    memset(g_stage, 0, sizeof(*g_stage));
+    g_stage->final_size = -1;
+    g_stage_base = resume_offset;
+    g_stage_waits = 0;
+    g_stage_exited = 0;
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("Ошибка pipe переноса лога");
+        close(stage_fd);
+        close(out_fd);
+        munmap(g_stage, sizeof(StageShared));
+        g_stage = NULL;
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Ошибка fork переноса лога");
+        close(fds[0]);
+        close(fds[1]);
+        close(stage_fd);
+        close(out_fd);
+        munmap(g_stage, sizeof(StageShared));
+        g_stage = NULL;
+        return -1;
+    }
+    if (pid == 0) {
+        /* завершается сам, когда всё перенесено */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        if (g_wdt_pipe >= 0)
+            close(g_wdt_pipe);
+        if (g_met_pipe >= 0)
+            close(g_met_pipe);
+        close(fds[1]);
+        (void)!nice(19);
+        /* ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE): в glibc обёртки нет */
+        syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+        stage_flusher(p, stage_path, stage_fd, out_fd, fds[0]);
+        _exit(0);
+    }
+
+    close(fds[0]);
+    close(stage_fd);
+    close(out_fd);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    g_stage_pipe = fds[1];
+    g_stage_pid  = pid;
+    return 0;
+}
+
+static void stage_wake(void)
+{
+    (void)!write(g_stage_pipe, "w", 1);
+}
+
+/* 0 — процесс переноса завершился (статус сохранён для stage_finish) */
+static int stage_alive(void)
+{
+    if (g_stage_exited)
+        return 0;
+    if (waitpid(g_stage_pid, &g_stage_status, WNOHANG) == 0)
+        return 1;
+    g_stage_exited = 1;
+    return 0;
+}
+
+/* 1 — перенос на носитель не идёт: ошибка записи или процесс завершился */
+static int stage_failed(void)
+{
+    return __atomic_load_n(&g_stage->error, __ATOMIC_RELAXED) != 0 || !stage_alive();
+}
+
+/*
+ * На шаге: ftello — без ввода-вывода на носитель; если в ОЗУ накопилось
+ * больше log_stage_max_kb, цикл ждёт переноса (носитель не успевает).
+ * -1 — перенос не работает (например, носитель заполнен): прогон
+ * прерывается, записанное остаётся в файле в ОЗУ.
+ */
+static int stage_check(FILE *f, const IterParams *p)
+{
+    int err = __atomic_load_n(&g_stage->error, __ATOMIC_RELAXED);
+    const int64_t max_bytes = (int64_t)p->log_stage_max_kb * 1024;
+    if (!err &&
+        (int64_t)ftello(f) - __atomic_load_n(&g_stage->copied, __ATOMIC_ACQUIRE) <= max_bytes)
+        return 0;
+
+    if (!err) {
+        if (g_stage_waits++ == 0)
+            fprintf(stderr, "Лог в ОЗУ: достигнут предел %ld КБ, цикл ждёт переноса на носитель\n",
+                    p->log_stage_max_kb);
+        fflush(f);
+        stage_wake();
+        while (!g_stop &&
+               (int64_t)ftello(f) - __atomic_load_n(&g_stage->copied, __ATOMIC_ACQUIRE) > max_bytes) {
+            if (stage_failed())
+                break;
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts, NULL);
+        }
+        if (g_stop || !stage_failed())
+            return 0;
+        err = __atomic_load_n(&g_stage->error, __ATOMIC_RELAXED);
+    }
+    fprintf(stderr, "Лог в ОЗУ: перенос на носитель не идёт (%s), прогон прерван\n",
+            err ? strerror(err) : "процесс переноса завершился");
+    return -1;
+}
+
+/* Контрольная точка: всё записанное — на носителе; смещение в логе на носителе.
+   -1 — не дождались (Ctrl+C или перенос не работает) */
+static off_t stage_sync(FILE *f)
+{
+    fflush(f);
+    int64_t target = (int64_t)ftello(f);
+    __atomic_store_n(&g_stage->sync_req, target, __ATOMIC_RELEASE);
+    stage_wake();
+    while (__atomic_load_n(&g_stage->synced, __ATOMIC_ACQUIRE) < target) {
+        if (g_stop || stage_failed())
+            return -1;
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    return (off_t)(g_stage_base + target);
+}
+
+/* Контрольная точка: лог сброшен на носитель, позиция — начало фазы */
+static void checkpoint_sync(FILE *f, Checkpoint *ck, long cycle, int phase, long microsteps)
+{
+    pk_flush();
+    off_t offset;
+    if (g_stage) {
+        offset = stage_sync(f);
+    } else {
+        fflush(f);
+        fdatasync(fileno(f));
+        offset = ftello(f);
+    }
+    /* прежняя контрольная точка остаётся в силе */
+    if (offset < 0) {
+        fprintf(stderr, "Контрольная точка не записана: лог не сброшен на носитель\n");
+        return;
+    }
+    ck->log_offset = offset;
+    ck->cycle      = cycle;
+    ck->phase      = phase;
+    ck->idx        = 0;
+    ck->microsteps = microsteps;
+    save_checkpoint(ck);
+    trace_now(TR_CHECKPOINT, 0);
+}
+
+/* Конец прогона: f уже закрыт; ждать переноса остатка и удалить файл в ОЗУ */
+static int stage_finish(const char *stage_path, int64_t stage_size)
+{
+    __atomic_store_n(&g_stage->final_size, stage_size, __ATOMIC_RELEASE);
+    stage_wake();
+    if (!g_stage_exited) {
+        while (waitpid(g_stage_pid, &g_stage_status, 0) < 0 && errno == EINTR)
+            ;
+        g_stage_exited = 1;
+    }
+    int status = g_stage_status;
+    int err = g_stage->error;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+             g_stage->copied >= stage_size;
+    if (ok)
+        unlink(stage_path);
+    else
+        fprintf(stderr, "Лог в ОЗУ: перенос не завершён (%s), копия сохранена: %s\n",
+                err ? strerror(err) : "процесс переноса", stage_path);
+
+    close(g_stage_pipe);
+    g_stage_pipe = -1;
+    g_stage_pid = -1;
+    munmap(g_stage, sizeof(StageShared));
+    g_stage = NULL;
+    return ok ? 0 : -1;
+}
+
+/*
+ * Фоновая запись файла: потомок получает снимок памяти (копия при записи),
+ * пишет с низким приоритетом и завершается через _exit; цикл шагов не ждёт.
+ * 0 — в потомке, >0 — в родителе, -1 — ошибка fork.
+ */
+static pid_t fork_writer(void)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        if (g_wdt_pipe >= 0)
+            close(g_wdt_pipe);
+        if (g_met_pipe >= 0)
+            close(g_met_pipe);
+        if (g_stage_pipe >= 0)
+            close(g_stage_pipe);
+        (void)!nice(10);
+    }
+    return pid;
+}
+
+/* 1 — предыдущая фоновая запись ещё идёт; wait — дождаться её */
+static int writer_busy(pid_t *pid, int wait)
+{
+    if (*pid <= 0)
+        return 0;
+    int rc;
+    while ((rc = waitpid(*pid, NULL, wait ? 0 : WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if (rc == 0)
+        return 1;
+    *pid = -1;
+    return 0;
+}
+
+/*
+ * Выгрузка самописца из шага: кольцо пишет потомок из снимка памяти,
+ * в шаге остаётся только fork. Пока идёт предыдущая выгрузка, новая
+ * пропускается.
+ */
+static void trace_dump_bg(int reason, pid_t *pid)
+{
+    if (writer_busy(pid, 0)) {
+        fprintf(stderr, "Трассировка: предыдущая выгрузка не завершена, пропуск\n");
+        return;
+    }
+    long no = ++g_tr.dumps;
+    trace_now(TR_DUMP_BEGIN, (int32_t)no);
+    *pid = fork_writer();
+    if (*pid == 0)
+        _exit(trace_dump(reason, no) == 0 ? 0 : 1);
+    if (*pid < 0)
+        perror("Ошибка fork выгрузки трассировки");
+    trace_now(TR_DUMP_END, (int32_t)no);
+}
+
+/*
+ * Ожидание фронта на DI. Фронт произошёл между двумя последними
+ * опросами: *prev_ns — опрос до фронта, *edge_ns — опрос, увидевший фронт.
+ * Возвращает -1 при Ctrl+C.
+ */
+static int wait_di_trigger(int fd_io, const IterParams *p,
+                           int64_t *prev_ns, int64_t *edge_ns)
+{
+    const unsigned int mask = 1u << p->trig_di;
+    unsigned int di = 0, dout = 0;
+    long errors = 0;
+    struct timespec t_poll;
+
+    /* исходный уровень: уже активный вход фронтом не считается */
+    while (DIO_GetValues(fd_io, IO_DI_TOTAL, IO_DO_TOTAL, &di, &dout) != 0) {
+        if (g_stop)
+            return -1;
+        ++errors;
+    }
+    int level = (di & mask) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &t_poll);
+
+    while (!g_stop) {
+        *prev_ns = timespec_to_ns(&t_poll);
+        if (p->trig_poll_us > 0) {
+            struct timespec t_next = t_poll;
+            timespec_add_us(&t_next, p->trig_poll_us);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_next, NULL);
+        }
+
+        int rc = DIO_GetValues(fd_io, IO_DI_TOTAL, IO_DO_TOTAL, &di, &dout);
+        clock_gettime(CLOCK_MONOTONIC, &t_poll);
+        if (rc != 0) {
+            ++errors;
+            continue;
+        }
+
+        int now_level = (di & mask) != 0;
+        if (now_level != level) {
+            level = now_level;
+            if (level != p->trig_falling) {
+                *edge_ns = timespec_to_ns(&t_poll);
+                if (errors > 0)
+                    fprintf(stderr, "Триггер: ошибок чтения DI %ld\n", errors);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static void handle_sigint(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+
+static void handle_sigusr1(int sig)
+{
+    (void)sig;
+    g_trace_req = 1;
+}
+
+/*
+ * Консоль. Цикл только обновляет снимок последнего шага; строка
+ * форматируется в конце шага, после записи лога: раз в console_rate_ms
+ * (console=summary) или на каждом шаге (console=step). Строка пишется
+ * через отдельное открытие stdout (/proc/self/fd/1) с O_NONBLOCK: общее
+ * с stderr и shell описание файла остаётся блокирующим. EAGAIN или
+ * неполная запись — строка отброшена и учтена; медленная SSH-сессия или
+ * канал в Node-RED шаги не задерживает.
+ */
+typedef struct {
+    long cycle;
+    int phase;
+    long idx;
+    double t_ms;
+    int iter_mV;
+    double iter_V;
+    unsigned int code;
+    double ao_V;
+    float ai[8];
+    long steps;               /* шагов с прошлой сводки */
+    long late_max_us;         /* наибольшее опоздание с прошлой сводки */
+    long misses;              /* опозданий больше wdt_late_us с прошлой сводки */
+    long dropped;             /* строк не выведено с прошлой записи */
+    long dropped_total;
+    int partial;              /* в терминале обрывок строки — начать с '\n' */
+    int64_t next_ns;          /* момент следующей сводки */
+    int fd;                   /* куда пишутся строки, -1 — console=off */
+    int how;                  /* CON_* */
+} ConsoleStatus;
+
+enum {
+    CON_OWN_FD,     /* своё описание файла с O_NONBLOCK (pty, канал) */
+    CON_SOCKET,     /* stdout — сокет: send(MSG_DONTWAIT) */
+    CON_FILE,       /* обычный файл: запись не ждёт читателя */
+    CON_POLL        /* повторно не открыть: запись, только если poll() готов */
+};
+
+/* 0 — строка выведена целиком */
+static int console_write(ConsoleStatus *cs, const char *buf, size_t len)
+{
+    ssize_t w;
+    if (cs->how == CON_SOCKET) {
+        w = send(cs->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+        if (cs->how == CON_POLL) {
+            struct pollfd pfd = { cs->fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))
+                return -1;
+        }
+        w = write(cs->fd, buf, len);
+    }
+    if (w == (ssize_t)len) {
+        cs->partial = 0;
+        return 0;
+    }
+    if (w > 0)
+        cs->partial = 1;
+    return -1;
+}
+
+/*
+ * Флаги общего описания stdout не меняются: иначе stderr и shell тоже
+ * становятся неблокирующими (и остаются такими после kill -9).
+ */
+static void console_begin(ConsoleStatus *cs, const IterParams *p)
+{
+    cs->fd = -1;
+    if (p->console_mode == CONSOLE_OFF)
+        return;
+    fflush(stdout);
+
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* новое открытие писало бы со своего смещения поверх stdio */
+        cs->fd = STDOUT_FILENO;
+        cs->how = CON_FILE;
+        return;
+    }
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        cs->fd = STDOUT_FILENO;
+        cs->how = CON_SOCKET;
+        return;
+    }
+    cs->fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (cs->fd >= 0) {
+        cs->how = CON_OWN_FD;
+    } else {
+        cs->fd = STDOUT_FILENO;
+        cs->how = CON_POLL;
+    }
+}
+
+static void console_end(ConsoleStatus *cs)
+{
+    if (cs->fd >= 0 && cs->how == CON_OWN_FD)
+        close(cs->fd);
+    cs->fd = -1;
+}
+
+static void console_tick(ConsoleStatus *cs, const IterParams *p, int64_t now_ns)
+{
+    if (p->console_mode == CONSOLE_SUMMARY && now_ns < cs->next_ns)
+        return;
+
+    char line[512];
+    int n = cs->partial ? snprintf(line, sizeof(line), "\n") : 0;
+    n += snprintf(line + n, sizeof(line) - (size_t)n,
+        "cycle=%ld phase=%d idx=%ld t=%.3f ms iter=%d mV (%.3f В) AO_code=%u AO_V=%.3f "
+        "AI=[%.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f]",
+        cs->cycle, cs->phase, cs->idx, cs->t_ms,
+        cs->iter_mV, cs->iter_V, cs->code, cs->ao_V,
+        cs->ai[0], cs->ai[1], cs->ai[2], cs->ai[3],
+        cs->ai[4], cs->ai[5], cs->ai[6], cs->ai[7]);
+    if (p->console_mode == CONSOLE_SUMMARY) {
+        n += snprintf(line + n, sizeof(line) - (size_t)n,
+                      " | шагов %ld, опоздание макс %ld мкс, >%ld мкс: %ld",
+                      cs->steps, cs->late_max_us, p->wdt_late_us, cs->misses);
+        cs->next_ns = now_ns + (int64_t)p->console_rate_ms * 1000000LL;
     }
+    if (cs->dropped > 0)
+        n += snprintf(line + n, sizeof(line) - (size_t)n,
+                      " | не выведено строк %ld", cs->dropped);
+    if (n > (int)sizeof(line) - 2)
+        n = (int)sizeof(line) - 2;
+    line[n++] = '\n';
 
-    FILE *f = fopen(fname, "w");
-    if (!f) {
-        perror("Ошибка открытия CSV");
-        return -1;
+    if (console_write(cs, line, (size_t)n) != 0) {
+        ++cs->dropped;
+        ++cs->dropped_total;
+        return;
     }
+    cs->dropped = 0;
+    cs->steps = 0;
+    cs->late_max_us = 0;
+    cs->misses = 0;
+}
+
+/* Аппаратура, открываемая один раз (в режиме демона — на все задания) */
+typedef struct {
+    int fd_io;
+    AoDevice devs[MAX_AO_DEVICES];
+    RemoteAi rai[MAX_REMOTE_AI];
+    struct timespec t_last_end;   /* конец последнего прогона */
+    int64_t reconnect_ns;         /* переподключение для самописца следующего прогона, 0 — нет */
+    long reconnects;
+} Hardware;
+
+static void hw_close(const IterParams *p, Hardware *hw)
+{
+    metrics_stop();
+    if (p->wdt_enabled)
+        watchdog_stop();
+    close_remote_ai(hw->rai, p->num_rai);
+    close_ao_devices(hw->devs, p->num_devices);
+    if (hw->fd_io >= 0)
+        AdamIO_Close(hw->fd_io);
+    hw->fd_io = -1;
+}
 
-    fprintf(f,
-        "cycle;phase;idx;time_ms;iter_mV;iter_V;code_set;ao_V;"
-        "AI0;AI1;AI2;AI3;AI4;AI5;AI6;AI7\n");
+static int hw_open(const IterParams *p, Hardware *hw)
+{
+    memset(hw, 0, sizeof(*hw));
+    hw->fd_io = -1;
 
     /* ADAM-6717 */
-    int fd_io = -1;
-    int ret = AdamIO_Open(&fd_io);
+    int ret = AdamIO_Open(&hw->fd_io);
     if (ret < 0) {
         fprintf(stderr, "Ошибка AdamIO_Open\n");
-        fclose(f);
+        hw->fd_io = -1;
         return -1;
     }
-    printf("ADAM-6717 открыт, fd=%d\n", fd_io);
+    printf("ADAM-6717 открыт, fd=%d\n", hw->fd_io);
 
-    AI_SetAutoFilterEnabled(fd_io, 0x00, 0);
-    AI_SetIntegrationMode(fd_io, 0xA0); // high speed
+    /* Режим АЦП — из параметров (по умолчанию high speed без фильтра) */
+    if (AI_SetAutoFilterEnabled(hw->fd_io, (unsigned char)p->ai_filter_mask,
+                                p->ai_filter_percent) != 0 ||
+        AI_SetIntegrationMode(hw->fd_io, (unsigned char)p->ai_integration_mode) != 0)
+        fprintf(stderr, "Внимание: режим AI не установлен, используется текущий\n");
+    printf("AI: integration_mode=0x%02X, фильтр: каналы 0x%02X, %d%%\n",
+           p->ai_integration_mode, p->ai_filter_mask, p->ai_filter_percent * 10);
 
-    /* ADAM-6224 */
-    modbus_t *ctx = modbus_new_tcp(ADAM6224_IP, ADAM6224_PORT);
-    if (!ctx) {
-        fprintf(stderr, "Ошибка modbus_new_tcp\n");
-        AdamIO_Close(fd_io);
-        fclose(f);
+    /* ADAM-6224 (один или несколько модулей AO) и удалённые модули AI */
+    if (connect_ao_devices(p, hw->devs) != 0 ||
+        connect_remote_ai(p, hw->rai) != 0 ||
+        (p->wdt_enabled && watchdog_start(p) != 0) ||
+        (p->metrics_port > 0 && metrics_start(p) != 0)) {
+        hw_close(p, hw);
         return -1;
     }
+    return 0;
+}
 
-    if (modbus_set_slave(ctx, ADAM6224_SLAVE) == -1) {
-        fprintf(stderr, "Ошибка modbus_set_slave\n");
-        modbus_free(ctx);
-        AdamIO_Close(fd_io);
-        fclose(f);
+/*
+ * Повторное подключение модулей AO и удалённых AI: после прогона,
+ * прерванного ошибкой Modbus, соединение может быть разорвано или
+ * содержать неразобранный ответ.
+ */
+static int hw_reconnect(const IterParams *p, Hardware *hw)
+{
+    if (g_met)
+        met_add(&g_met->modbus_reconnects, 1);
+    close_remote_ai(hw->rai, p->num_rai);
+    close_ao_devices(hw->devs, p->num_devices);
+    if (connect_ao_devices(p, hw->devs) != 0 ||
+        connect_remote_ai(p, hw->rai) != 0)
+        return -1;
+
+    /* кольцо самописца между прогонами выключено — событие пишет следующий */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    hw->reconnect_ns = timespec_to_ns(&ts);
+    ++hw->reconnects;
+    return 0;
+}
+
+/*
+ * Один прогон по загруженным и проверенным параметрам на уже открытой
+ * аппаратуре. out_name — имя лога (NULL — iter_8ch_<время>),
+ * not_before — не начинать t0 раньше этого момента (пауза между
+ * заданиями демона). Возвращает 0 при завершении или остановке по Ctrl+C.
+ */
+static int run_job(Hardware *hw, IterParams *par, const char *params_path,
+                   const char *out_name, int resume,
+                   const struct timespec *not_before)
+{
+    const int fd_io = hw->fd_io;
+    AoDevice *devs = hw->devs;
+    RemoteAi *rai = hw->rai;
+
+    if (load_calibration(par->calib_file) != 0) {
         return -1;
     }
 
-    if (modbus_connect(ctx) == -1) {
-        fprintf(stderr, "Ошибка modbus_connect: %s\n", modbus_strerror(errno));
-        modbus_free(ctx);
-        AdamIO_Close(fd_io);
-        fclose(f);
+    static PhaseSeq seqs[MAX_PHASES];
+    if (build_phase_seqs(par, seqs) != 0 ||
+        (par->aggregate && agg_init(par, seqs) != 0)) {
+        release_phase_seqs(seqs, par->num_phases);
         return -1;
     }
 
-    signal(SIGINT, handle_sigint);
+    printf("Параметры (фаз: %d):\n", par->num_phases);
+    for (int i = 0; i < par->num_phases; ++i) {
+        IterPhase *phase = &par->phases[i];
+        printf("  Фаза %d:\n", i + 1);
+        if (phase->wave_file[0] != '\0') {
+            printf("    wave_file = %s (%ld отсчётов)\n",
+                   phase->wave_file, seqs[i].n_steps);
+        } else if (phase->profile == PROFILE_SINE) {
+            printf("    profile   = sine\n");
+            printf("    amp_mV    = %d\n", phase->amp_mV);
+            printf("    offset_mV = %d\n", phase->offset_mV);
+            printf("    freq_Hz   = %.6f (задано %.6f)\n",
+                   1.0e6 / ((double)seqs[i].period_len * (double)phase->period_us),
+                   phase->freq_Hz);
+            printf("    periods   = %ld\n", phase->periods);
+            if (phase->lockin_periods > 0)
+                printf("    lock-in   = блок %ld периодов (%ld шагов)\n",
+                       phase->lockin_periods, phase->lockin_periods * seqs[i].period_len);
+        } else if (phase->profile == PROFILE_PRBS) {
+            printf("    profile   = prbs (порядок %d, seed=0x%x)\n",
+                   phase->prbs_order, phase->seed);
+            printf("    уровни    = %d / %d мВ\n", phase->start_mV, phase->end_mV);
+            printf("    dwell     = %ld шагов\n", dwell_steps(phase));
+            printf("    periods   = %ld\n", phase->periods);
+        } else {
+            if (phase->profile != PROFILE_LINEAR) {
+                printf("    profile   = %s\n", profile_name(phase->profile));
+                printf("    periods   = %ld\n", phase->periods);
+            }
+            if (phase->profile == PROFILE_STAIRCASE)
+                printf("    dwell     = %ld шагов\n", dwell_steps(phase));
+            printf("    start_mV  = %d\n", phase->start_mV);
+            printf("    end_mV    = %d\n", phase->end_mV);
+            printf("    step_mV   = %d\n", phase->step_mV);
+        }
+        printf("    period_us = %ld\n", phase->period_us);
+        printf("    settle_us = %ld\n", phase->settle_us);
+        printf("    pause_ms  = %d\n", phase->pause_ms);
+    }
+    printf("  repeats = %ld (0 = бесконечный цикл)\n", par->repeats);
+    for (int i = 0; i < par->num_devices; ++i) {
+        printf("  dev%d = %s:%d slave=%d reg=%d\n", i,
+               par->devices[i].ip, par->devices[i].port,
+               par->devices[i].slave, par->devices[i].reg);
+    }
+    for (int i = 0; i < par->num_rai; ++i) {
+        printf("  rai%d = %s:%d slave=%d reg=%d count=%d (gain=%g, offset=%g)\n", i,
+               par->rai[i].ip, par->rai[i].port, par->rai[i].slave,
+               par->rai[i].reg, par->rai[i].count, par->rai[i].gain, par->rai[i].offset);
+    }
+    if (par->calib_file[0] != '\0')
+        printf("  calib_file = %s\n", par->calib_file);
+    if (par->aggregate) {
+        printf("  aggregate = 1 (точек %ld, сброс каждые %ld циклов, сырые строки: %s)\n",
+               g_agg_points, par->agg_dump_cycles, par->agg_raw ? "да" : "нет");
+    }
+    if (par->pid_enabled) {
+        printf("  control_mode = pid (AI%d, kp=%g, ki=%g 1/с, kd=%g с, выход %.3f..%.3f В)\n",
+               par->pid_channel, par->pid_kp, par->pid_ki, par->pid_kd,
+               par->pid_out_min_V, par->pid_out_max_V);
+    }
+    if (par->settle_adaptive) {
+        printf("  settle_mode = adaptive (каналы 0x%02X, K=%d, допуск %.3f мВ, опрос %ld мкс)\n",
+               par->settle_mask, par->settle_count, par->settle_tol_V * 1000.0,
+               par->settle_poll_us);
+        if (par->settle_early)
+            printf("  settle_early = 1 (min_period_us = %ld)\n", par->min_period_us);
+    }
+    if (par->ai_stagger) {
+        printf("  смещения AI, мкс:");
+        for (int ch = 0; ch < 8; ++ch) {
+            if (par->ai_settle_us[ch] >= 0)
+                printf(" AI%d=%ld", ch, par->ai_settle_us[ch]);
+            else
+                printf(" AI%d=settle", ch);
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    uint64_t params_hash = hash_file(params_path);
+    Checkpoint ck;
+    memset(&ck, 0, sizeof(ck));
+    if (resume) {
+        if (load_checkpoint(&ck) != 0 ||
+            validate_checkpoint(&ck, par, seqs, params_hash) != 0) {
+            release_phase_seqs(seqs, par->num_phases);
+            return -1;
+        }
+        printf("Продолжение с контрольной точки: цикл %ld, фаза %d, шаг %ld, лог %s\n",
+               ck.cycle + 1, ck.phase + 1, ck.idx, ck.log_file);
+    }
+
+    /* Заготовка лога CSV */
+    char fname[256];
+    time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    if (resume) {
+        snprintf(fname, sizeof(fname), "%s", ck.log_file);
+    } else if (out_name) {
+        snprintf(fname, sizeof(fname), "%s", out_name);
+    } else {
+        /* абсолютный путь — чтобы --resume нашёл лог из любого каталога */
+        char dir[160] = "";
+        if (par->checkpoint_enabled && getcwd(dir, sizeof(dir) - 1))
+            strcat(dir, "/");
+        else
+            dir[0] = '\0';
+
+        snprintf(fname, sizeof(fname),
+                 "%siter_8ch_%04d%02d%02d_%02d%02d%02d.%s",
+                 dir,
+                 tm_now.tm_year + 1900,
+                 tm_now.tm_mon + 1,
+                 tm_now.tm_mday,
+                 tm_now.tm_hour,
+                 tm_now.tm_min,
+                 tm_now.tm_sec,
+                 par->log_packed ? "bin" : "csv");
+    }
+
+    /* Усреднённая кривая — рядом с логом; после --resume — новый файл */
+    char avg_fname[256] = "";
+    if (par->aggregate)
+        sibling_log_name(avg_fname, sizeof(avg_fname), fname, "iter_avg_", &tm_now);
+
+    /* Лог в ОЗУ: цикл пишет в log_stage_dir, на носитель — фоновый перенос */
+    char stage_path[CALIB_PATH_LEN + 256] = "";
+    if (par->log_stage_dir[0] != '\0') {
+        const char *slash = strrchr(fname, '/');
+        snprintf(stage_path, sizeof(stage_path), "%s/%s",
+                 par->log_stage_dir, slash ? slash + 1 : fname);
+    }
+
+    FILE *f;
+    if (stage_path[0] != '\0') {
+        /* строки после контрольной точки отбрасываются прямо на носителе */
+        struct stat st;
+        if (resume && (stat(fname, &st) != 0 || st.st_size < ck.log_offset ||
+                       truncate(fname, ck.log_offset) != 0)) {
+            fprintf(stderr, "Ошибка --resume: CSV короче контрольной точки\n");
+            release_phase_seqs(seqs, par->num_phases);
+            return -1;
+        }
+        f = fopen(stage_path, "w");
+        if (f && stage_start(par, stage_path, fname, resume ? ck.log_offset : 0) != 0) {
+            fclose(f);
+            unlink(stage_path);
+            f = NULL;
+        }
+    } else {
+        f = fopen(fname, resume ? "r+" : "w");
+    }
+    if (!f) {
+        perror("Ошибка открытия CSV");
+        release_phase_seqs(seqs, par->num_phases);
+        return -1;
+    }
+    if (par->log_packed)
+        pk_open(f, par, 0);
+
+    if (resume) {
+        /* строки после контрольной точки отбрасываются: фаза будет повторена */
+        if (!g_stage) {
+            fseeko(f, 0, SEEK_END);
+            if (ftello(f) < ck.log_offset ||
+                ftruncate(fileno(f), ck.log_offset) != 0 ||
+                fseeko(f, ck.log_offset, SEEK_SET) != 0) {
+                fprintf(stderr, "Ошибка --resume: CSV короче контрольной точки\n");
+                fclose(f);
+                release_phase_seqs(seqs, par->num_phases);
+                return -1;
+            }
+        }
+        log_comment(f, "#resume;%ld;%d;%ld\n", ck.cycle + 1, ck.phase + 1, ck.idx);
+    } else {
+        write_csv_header(f, par);
+    }
+
+    /* Самописец: кольцо очищается в начале каждого прогона */
+    memset(&g_tr, 0, sizeof(g_tr));
+    if (par->trace_enabled) {
+        sibling_log_name(g_tr.base, sizeof(g_tr.base), fname, "iter_trace_", &tm_now);
+        g_tr.base[strlen(g_tr.base) - 4] = '\0';    /* без .csv */
+        g_tr.mask = (uint32_t)par->trace_events - 1;
+        g_tr.on = 1;
+    }
+    if (hw->reconnect_ns) {
+        trace_at(TR_RECONNECT, hw->reconnect_ns, (int32_t)hw->reconnects);
+        hw->reconnect_ns = 0;
+    }
+    int trace_holdoff = 0;      /* шаг после выгрузки автовыгрузку не вызывает */
+    pid_t trace_pid = -1;       /* фоновая выгрузка самописца */
+
+    /* Начальная контрольная точка — до t0, вне расписания шагов */
+    ck.params_hash = params_hash;
+    snprintf(ck.log_file, sizeof(ck.log_file), "%s", fname);
+    if (par->checkpoint_enabled && !resume)
+        checkpoint_sync(f, &ck, 0, 0, 0);
+
+    if (not_before)
+        sleep_until(not_before);
 
     struct timespec t0, t_set;
     clock_gettime(CLOCK_MONOTONIC, &t0);
     t_set = t0;
+    const int64_t t0_ns = timespec_to_ns(&t0);
+    g_pk.t0_ns = t0_ns;
+    g_tr.t0_ns = t0_ns;
+    if (g_met) {
+        met_add(&g_met->runs, 1);
+        met_set(&g_met->running, 1);
+    }
+
+    /* Привязка часов сразу после заголовка и затем каждые anchor_interval_s */
+    int64_t next_anchor_ns = write_clock_anchor(f) +
+                             (int64_t)par->anchor_interval_s * 1000000000LL;
 
     /* Массив предыдущих значений для 8 каналов */
     float prev_ai[8];
     for (int i = 0; i < 8; i++)
         prev_ai[i] = 0.0f;
 
-    long total_microsteps = 0;
+    /* ПИД: начальное измерение обратной связи до t0 */
+    PidState pid;
+    LoopStats loop_stats;
+    memset(&loop_stats, 0, sizeof(loop_stats));
+    if (par->pid_enabled) {
+        unsigned char st = 0;
+        AI_GetFloatValue(fd_io, par->pid_channel, &prev_ai[par->pid_channel], &st);
+        pid_init(&pid, (double)(prev_ai[par->pid_channel] * g_ai_gain[par->pid_channel] +
+                                g_ai_off[par->pid_channel]));
+    }
+
+    long total_microsteps = resume ? ck.microsteps : 0;
+    long next_step_us = -1;     /* период до следующего шага при раннем старте */
     int first_step = 1;
     int abort_loops = 0;
 
+    /* Аппаратная синхронизация */
+    int trig_pending = par->trig_di >= 0;
+    int trig_log = 0;
+    int64_t trig_prev_ns = 0, trig_edge_ns = 0;
+    unsigned char do_level = 0;
+    long do_us_max = 0, do_n = 0, do_err = 0;
+    long verify_wait = 0, verify_n = 0, verify_bad = 0, verify_err = 0;
+    int64_t do_us_sum = 0;
+
+    long agg_cycles = 0;
+    pid_t agg_pid = -1;         /* фоновая запись iter_avg_* */
+    const int log_raw = !par->aggregate || par->agg_raw;
+
+    const int log_thin = par->log_every > 1 || par->deadband_enabled;
+    float last_ai[8] = { 0 };
+    long skipped = 0, skipped_total = 0, rows_written = 0;
+
+    /* Lock-in: результаты блоков — отдельным файлом рядом с логом */
+    FILE *f_lockin = NULL;
+    LockIn lockin;
+    lockin_reset(&lockin);
+    for (int i = 0; i < par->num_phases; ++i) {
+        if (par->phases[i].lockin_periods > 0 && !f_lockin) {
+            char lk_fname[256];
+            sibling_log_name(lk_fname, sizeof(lk_fname), fname, "iter_lockin_", &tm_now);
+            f_lockin = fopen(lk_fname, "w");
+            if (!f_lockin) {
+                perror("Ошибка открытия файла lock-in, блоки не записываются");
+                break;
+            }
+            write_lockin_header(f_lockin);
+            printf("Результаты lock-in: %s\n", lk_fname);
+        }
+    }
+
+    ConsoleStatus con;
+    memset(&con, 0, sizeof(con));
+
     printf("Запуск итерации 8-канального измерения...\n\n");
+    console_begin(&con, par);
 
-    for (long cycle = 0;
-         (par.repeats == 0 || cycle < par.repeats) && !g_stop && !abort_loops;
+    for (long cycle = resume ? ck.cycle : 0;
+         (par->repeats == 0 || cycle < par->repeats) && !g_stop && !abort_loops;
          ++cycle)
     {
         long cycle_num = cycle + 1;
+        if (par->trig_each_cycle && par->trig_di >= 0)
+            trig_pending = 1;
 
-        for (int phase_idx = 0;
-             phase_idx < par.num_phases && !g_stop && !abort_loops;
+        for (int phase_idx = resume ? ck.phase : 0;
+             phase_idx < par->num_phases && !g_stop && !abort_loops;
              ++phase_idx)
         {
-            IterPhase *phase = &par.phases[phase_idx];
-            int dir = (phase->step_mV > 0) ? 1 : -1;
-            int idx = 0;
-            int iter_mV = phase->start_mV;
-
-            while (!g_stop &&
-                   ((dir > 0 && iter_mV <= phase->end_mV) ||
-                    (dir < 0 && iter_mV >= phase->end_mV)))
+            IterPhase *phase = &par->phases[phase_idx];
+            PhaseSeq *seq = &seqs[phase_idx];
+            long idx_start = resume ? ck.idx : 0;
+            resume = 0;
+            seq->ra_next = 0;
+            long pos = idx_start % seq->period_len;
+            long lockin_len = phase->lockin_periods * seq->period_len;
+            lockin_reset(&lockin);
+            if (par->pid_enabled)
+                pid_set_period(&pid, par, phase->period_us);
+            trace_now(TR_PHASE, phase_idx + 1);
+            if (g_met) {
+                met_set(&g_met->cycle, cycle_num);
+                met_set(&g_met->phase, phase_idx + 1);
+            }
+
+            /* Старт по фронту DI: расписание отсчитывается от момента,
+               когда опрос увидел фронт */
+            if (trig_pending) {
+                trig_pending = 0;
+                printf("Ожидание %s фронта DI%d...\n",
+                       par->trig_falling ? "заднего" : "переднего", par->trig_di);
+                fflush(stdout);
+                watchdog_suspend();
+                if (wait_di_trigger(fd_io, par, &trig_prev_ns, &trig_edge_ns) != 0)
+                    break;
+                ns_to_timespec(trig_edge_ns, &t_set);
+                trace_at(TR_TRIGGER, trig_edge_ns, par->trig_di);
+                first_step = 1;
+                next_step_us = -1;
+                trig_log = 1;
+            }
+
+            for (long idx = idx_start; idx < seq->n_steps && !g_stop; ++idx)
             {
                 /* ABSOLUTE ожидание начала шага */
                 if (!first_step) {
-                    timespec_add_ms(&t_set, phase->period_ms);
+                    timespec_add_us(&t_set, next_step_us >= 0 ? next_step_us
+                                                              : phase->period_us);
+                    next_step_us = -1;
                 } else {
                     first_step = 0;
                 }
 
-                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_set, NULL);
+                wave_readahead(seq, pos);
+
+                sleep_until(&t_set);
 
-                /* Установка AO0 */
-                double iter_V = (double)iter_mV / 1000.0;
+                struct timespec t_wake;
+                clock_gettime(CLOCK_MONOTONIC, &t_wake);
+                int64_t wake_ns = timespec_to_ns(&t_wake);
+                long late_us = timespec_diff_us(&t_wake, &t_set);
+                trace_at(TR_WAKE, wake_ns, (int32_t)late_us);
+                if (par->trace_late_us > 0 && late_us > par->trace_late_us)
+                    trace_at(TR_LATE, wake_ns, (int32_t)late_us);
+                trace_at(TR_AO_BEGIN, wake_ns, 0);
+
+                /* Установка AO0: код предрасчитан до t0,
+                   калибровка — одна выборка из таблицы */
+                long step_pos = pos;
+                uint16_t code_prof = seq->code[pos];
+                int iter_mV = seq->mV ? seq->mV[pos] : g_code_mV[code_prof];
+                if (++pos == seq->period_len)
+                    pos = 0;
+                double iter_V = (double)iter_mV * 0.001;
                 if (iter_V < AO_MIN_V) iter_V = AO_MIN_V;
                 if (iter_V > AO_MAX_V) iter_V = AO_MAX_V;
 
-                uint16_t code_set = voltage_to_code(iter_V);
-                ret = modbus_write_register(ctx, AO0_REG_ADDR, code_set);
-                if (ret == -1) {
-                    fprintf(stderr, "Ошибка modbus_write_register: %s\n",
-                            modbus_strerror(errno));
+                /* ПИД: профиль — уставка, код AO — выход регулятора
+                   по измерению предыдущего шага */
+                if (par->pid_enabled) {
+                    int ch = par->pid_channel;
+                    double u = pid_update(&pid, par, iter_V,
+                                          (double)(prev_ai[ch] * g_ai_gain[ch] + g_ai_off[ch]));
+                    code_prof = voltage_to_code(u);
+                }
+
+                uint16_t dev_codes[MAX_AO_DEVICES];
+                for (int d = 0; d < par->num_devices; ++d)
+                    dev_codes[d] = g_ao_lut[d][code_prof];
+                uint16_t code_set = dev_codes[0];
+
+                long skew_us = 0;
+                if (ao_write_all(par, devs, dev_codes, &skew_us) != 0) {
+                    trace_now(TR_AO_FAIL, 0);
+                    if (g_met)
+                        met_add(&g_met->ao_errors, 1);
                     abort_loops = 1;
+                    /* Прогон прерывается: сторож уже не увидит остановки,
+                       безопасный код пишется сразу, по новым соединениям */
+                    if (par->wdt_enabled) {
+                        watchdog_suspend();
+                        wdt_safe_output(par, "ошибка записи AO, прогон прерван");
+                    }
                     break;
                 }
 
+                struct timespec t_written;
+                clock_gettime(CLOCK_MONOTONIC, &t_written);
+                trace_at(TR_AO_END, timespec_to_ns(&t_written), code_set);
+
+                /* Метка шага на DO сразу после записи AO */
+                int64_t do_done_ns = 0;
+                long do_us = 0;
+                if (par->sync_do >= 0) {
+                    do_level ^= 1;
+                    trace_at(TR_DO_BEGIN, timespec_to_ns(&t_written), 0);
+                    int do_ret = DO_SetValue(fd_io, par->sync_do, do_level);
+                    struct timespec t_do;
+                    clock_gettime(CLOCK_MONOTONIC, &t_do);
+                    trace_at(TR_DO_END, timespec_to_ns(&t_do), do_ret);
+                    if (do_ret != 0) {
+                        /* уровень не сменился: метки шага нет, следующий шаг повторит */
+                        do_level ^= 1;
+                        do_us = -1;
+                        ++do_err;
+                    } else {
+                        do_done_ns = timespec_to_ns(&t_do);
+                        do_us = timespec_diff_us(&t_do, &t_written);
+                        do_us_sum += do_us;
+                        ++do_n;
+                        if (do_us > do_us_max)
+                            do_us_max = do_us;
+                    }
+                }
+                long write_us = timespec_diff_us(&t_written, &t_wake);
+                if (par->pid_enabled)
+                    loop_stats_add(&loop_stats, late_us, write_us);
+
+                /* Сторож кормится только шагами, выполненными в срок */
+                if (par->wdt_enabled && late_us <= par->wdt_late_us)
+                    watchdog_feed(par, wake_ns, phase->period_us);
+
                 /* Ожидание settle */
                 struct timespec t_meas = t_set;
-                timespec_add_ms(&t_meas, phase->settle_ms);
+                timespec_add_us(&t_meas, seq->ai.n > 0 ? seq->ai.group[0].offset_us
+                                                       : phase->settle_us);
 
-                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_meas, NULL);
+                long settle_us = phase->settle_us;
+                if (par->settle_adaptive)
+                    settle_us = adaptive_settle(fd_io, par, &t_set, &t_meas);
+                else
+                    sleep_until(&t_meas);
 
-                /* Время шага */
+                /* Время шага: целые нс, time_ms — только для совместимости */
                 struct timespec t_now;
                 clock_gettime(CLOCK_MONOTONIC, &t_now);
-                double t_ms = timespec_to_ms(&t_now) - timespec_to_ms(&t0);
-
-                /* Измерение 8 каналов */
-                float ai[8];
-                for (int ch = 0; ch < 8; ch++) {
-                    unsigned char st = 0;
-                    int ai_ret = AI_GetFloatValue(fd_io, ch, &ai[ch], &st);
-                    if (ai_ret != 0) {
-                        ai[ch] = prev_ai[ch]; // использовать предыдущее
-                    } else {
-                        prev_ai[ch] = ai[ch];
+                int64_t ai_start_ns = timespec_to_ns(&t_now);
+                double t_ms = (double)(ai_start_ns - t0_ns) * 1.0e-6;
+                trace_at(TR_AI_BEGIN, ai_start_ns, 0);
+
+                /* Удалённые AI: запросы уходят до локального чтения,
+                   ответы собираются после — задержки не складываются */
+                remote_ai_request(par, rai);
+
+                /* Измерение 8 каналов: подряд или по расписанию aiN_settle_ms */
+                float ai_raw[8], ai[8];
+                int64_t ai_t_ns[8];
+                long ai_read_us = 0;
+                int ai_err = 0;
+                if (seq->ai.n > 0) {
+                    ai_err = ai_read_sched(fd_io, &seq->ai, &t_set, ai_raw, prev_ai,
+                                           ai_t_ns, &ai_read_us);
+                } else {
+                    for (int ch = 0; ch < 8; ch++) {
+                        unsigned char st = 0;
+                        int ai_ret = AI_GetFloatValue(fd_io, ch, &ai_raw[ch], &st);
+                        if (ai_ret != 0) {
+                            ai_raw[ch] = prev_ai[ch]; // использовать предыдущее
+                            ++ai_err;
+                        } else {
+                            prev_ai[ch] = ai_raw[ch];
+                        }
                     }
                 }
+                struct timespec t_ai_end;
+                clock_gettime(CLOCK_MONOTONIC, &t_ai_end);
+                int64_t ai_end_ns = timespec_to_ns(&t_ai_end);
+                if (seq->ai.n == 0)
+                    ai_read_us = (long)((ai_end_ns - ai_start_ns) / 1000);
+                trace_at(TR_AI_END, ai_end_ns, ai_err);
 
-                /* AO: расчётное значение */
-                double ao_V = code_to_voltage(code_set);
-
-                /* Запись CSV */
-                fprintf(f,
-                    "%ld;%d;%d;%.3f;%d;%.6f;%u;%.6f;"
-                    "%.6f;%.6f;%.6f;%.6f;%.6f;%.6f;%.6f;%.6f\n",
-                    cycle_num,
-                    phase_idx + 1, idx, t_ms,
-                    iter_mV, iter_V,
-                    (unsigned int)code_set,
-                    ao_V,
-                    (double)ai[0], (double)ai[1], (double)ai[2], (double)ai[3],
-                    (double)ai[4], (double)ai[5], (double)ai[6], (double)ai[7]
-                );
-
-                /* stdout — отладочный вывод */
-                printf(
-                    "cycle=%ld phase=%d idx=%d t=%.3f ms iter=%d mV (%.3f В) AO_code=%u AO_V=%.3f "
-                    "AI=[%.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f]\n",
-                    cycle_num,
-                    phase_idx + 1, idx, t_ms,
-                    iter_mV, iter_V,
-                    (unsigned int)code_set,
-                    ao_V,
-                    ai[0], ai[1], ai[2], ai[3], ai[4], ai[5], ai[6], ai[7]
-                );
-                fflush(stdout);
+                ai_apply_calibration(ai_raw, ai);
+
+                if (par->num_rai > 0) {
+                    struct timespec t_window_end = t_set;
+                    timespec_add_us(&t_window_end, phase->period_us - par->rai_margin_us);
+                    trace_at(TR_RAI_BEGIN, ai_end_ns, 0);
+                    remote_ai_collect(par, rai, &t_window_end, &t0);
+                    trace_now(TR_RAI_END, 0);
+                }
+
+                /* Проверка AO чтением: каждый N-й шаг или при запасе
+                   времени до следующего шага */
+                int ao_check = AO_VERIFY_SKIP;
+                if (par->ao_verify_every > 0 || par->ao_verify_slack_us > 0) {
+                    struct timespec t_next = t_set;
+                    timespec_add_us(&t_next, phase->period_us);
+                    int due = par->ao_verify_every > 0 && ++verify_wait >= par->ao_verify_every;
+                    if (!due && par->ao_verify_slack_us > 0) {
+                        struct timespec t_chk;
+                        clock_gettime(CLOCK_MONOTONIC, &t_chk);
+                        due = timespec_diff_us(&t_next, &t_chk) >= par->ao_verify_slack_us;
+                    }
+                    if (due) {
+                        verify_wait = 0;
+                        ao_check = ao_verify(par, devs, dev_codes, &t_next, f, cycle_num,
+                                             phase_idx + 1, idx);
+                        ++verify_n;
+                        if (ao_check == AO_VERIFY_MISMATCH) {
+                            ++verify_bad;
+                            if (g_met)
+                                met_add(&g_met->ao_verify_mismatches, 1);
+                        } else if (ao_check == AO_VERIFY_ERROR) {
+                            ++verify_err;
+                        }
+                    }
+                }
+
+                /* AO: расчётное (с учётом калибровки) значение */
+                double ao_V = g_ao_V[0][code_set];
+
+                if (par->aggregate)
+                    agg_add(&g_agg[g_agg_base[phase_idx] + idx], iter_mV, ai);
+
+                if (seq->ref_sin) {
+                    if (lockin.n == 0)
+                        lockin.t_start_ns = timespec_to_ns(&t_set);
+                    lockin_add(&lockin, ai, seq->ref_sin[step_pos], seq->ref_cos[step_pos]);
+                    if (lockin.n == lockin_len) {
+                        if (f_lockin)
+                            lockin_flush(f_lockin, &lockin, cycle_num, phase_idx + 1,
+                                         1.0e6 / ((double)seq->period_len * (double)phase->period_us));
+                        else
+                            lockin_reset(&lockin);
+                    }
+                }
+
+                /* Запись CSV; при прореживании решение — до форматирования */
+                trace_now(TR_LOG_BEGIN, 0);
+                int write_row = log_raw;
+                if (write_row && log_thin) {
+                    write_row = log_row_due(par, idx, seq->n_steps, ai, last_ai, skipped);
+                    if (!write_row) {
+                        ++skipped;
+                        ++skipped_total;
+                    }
+                }
+                if (write_row && par->log_packed) {
+                    pk_row(cycle_num, phase_idx + 1, idx, phase->period_us,
+                           iter_mV, code_set,
+                           timespec_to_ns(&t_set), timespec_to_ns(&t_written),
+                           ai_start_ns, ai_end_ns, ai);
+                } else if (write_row) {
+                    fprintf(f,
+                        "%ld;%d;%ld;%.3f;%d;%.6f;%u;%.6f;"
+                        "%.6f;%.6f;%.6f;%.6f;%.6f;%.6f;%.6f;%.6f",
+                        cycle_num,
+                        phase_idx + 1, idx, t_ms,
+                        iter_mV, iter_V,
+                        (unsigned int)code_set,
+                        ao_V,
+                        (double)ai[0], (double)ai[1], (double)ai[2], (double)ai[3],
+                        (double)ai[4], (double)ai[5], (double)ai[6], (double)ai[7]
+                    );
+                    fprintf(f, ";%" PRId64 ";%" PRId64 ";%" PRId64 ";%" PRId64,
+                            timespec_to_ns(&t_set), timespec_to_ns(&t_written),
+                            ai_start_ns, ai_end_ns);
+                    if (par->settle_adaptive)
+                        fprintf(f, ";%ld", settle_us);
+                    if (par->pid_enabled)
+                        fprintf(f, ";%.6f;%.6f;%.6f;%.6f;%.6f;%.6f;%ld;%ld",
+                                pid.y_prev, pid.err, pid.p, pid.integ, pid.d, pid.u,
+                                late_us, write_us);
+                    if (par->num_devices > 1) {
+                        for (int d = 0; d < par->num_devices; ++d)
+                            fprintf(f, ";%u;%ld", (unsigned int)dev_codes[d], devs[d].lat_us);
+                        fprintf(f, ";%ld", skew_us);
+                    }
+                    for (int r = 0; r < par->num_rai; ++r) {
+                        fprintf(f, ";%.3f", rai[r].t_ms);
+                        for (int ch = 0; ch < par->rai[r].count; ++ch)
+                            fprintf(f, ";%.6f", (double)rai[r].val[ch]);
+                    }
+                    if (par->sync_do >= 0)
+                        fprintf(f, ";%" PRId64 ";%ld", do_done_ns, do_us);
+                    if (log_thin)
+                        fprintf(f, ";%ld", skipped);
+                    if (par->ao_verify_every > 0 || par->ao_verify_slack_us > 0)
+                        fprintf(f, ";%d", ao_check);
+                    if (par->ai_stagger) {
+                        for (int ch = 0; ch < 8; ++ch)
+                            fprintf(f, ";%" PRId64, ai_t_ns[ch]);
+                    }
+                    fputc('\n', f);
+                }
+                if (write_row && log_thin) {
+                    skipped = 0;
+                    for (int ch = 0; ch < 8; ++ch)
+                        last_ai[ch] = ai[ch];
+                    ++rows_written;
+                }
+                trace_now(TR_LOG_END, write_row);
+
+                if (g_met) {
+                    met_add(&g_met->steps, 1);
+                    if (late_us > par->wdt_late_us)
+                        met_add(&g_met->deadline_misses, 1);
+                    met_add(&g_met->ai_fallbacks, (uint64_t)ai_err);
+                    met_add(&g_met->log_rows, (uint64_t)write_row);
+                    met_set(&g_met->last_late_us, late_us);
+                    met_set(&g_met->log_pending_bytes,
+                            par->log_packed ? (int64_t)g_pk.len : (int64_t)__fpending(f));
+                    met_observe(&g_met->late, late_us);
+                    met_observe(&g_met->ao_write, write_us);
+                    met_observe(&g_met->ai_read, ai_read_us);
+                }
+
+                if (g_stage && stage_check(f, par) != 0) {
+                    abort_loops = 1;
+                    break;
+                }
+
+                /* Задержка «фронт DI -> первая запись AO» */
+                if (trig_log) {
+                    trig_log = 0;
+                    int64_t ao_done_ns = timespec_to_ns(&t_written);
+                    log_comment(f, "#trigger;%ld;%" PRId64 ";%" PRId64 ";%" PRId64 ";%" PRId64 "\n",
+                            cycle_num, trig_prev_ns, trig_edge_ns, ao_done_ns,
+                            (ao_done_ns - trig_edge_ns) / 1000);
+                }
+
+                /* после записи строки — запас до следующего t_set */
+                if (par->wdt_enabled && late_us <= par->wdt_late_us)
+                    watchdog_feed_module(par, fd_io, wake_ns);
+
+                if (par->anchor_interval_s > 0 && ai_end_ns >= next_anchor_ns) {
+                    next_anchor_ns = write_clock_anchor(f) +
+                                     (int64_t)par->anchor_interval_s * 1000000000LL;
+                }
+
+                /* Консоль: снимок шага, строка — по расписанию */
+                trace_now(TR_CON_BEGIN, 0);
+                con.cycle   = cycle_num;
+                con.phase   = phase_idx + 1;
+                con.idx     = idx;
+                con.t_ms    = t_ms;
+                con.iter_mV = iter_mV;
+                con.iter_V  = iter_V;
+                con.code    = code_set;
+                con.ao_V    = ao_V;
+                memcpy(con.ai, ai, sizeof(con.ai));
+                ++con.steps;
+                if (late_us > con.late_max_us)
+                    con.late_max_us = late_us;
+                if (late_us > par->wdt_late_us)
+                    ++con.misses;
+                if (par->console_mode != CONSOLE_OFF)
+                    console_tick(&con, par, ai_end_ns);
+
+                /* Самописец: перегрузка шага и выгрузки — после всей работы
+                   шага, вне окна измерения; опоздание, вызванное самой
+                   выгрузкой, новую не вызывает */
+                if (g_tr.on) {
+                    struct timespec t_end;
+                    clock_gettime(CLOCK_MONOTONIC, &t_end);
+                    int64_t end_ns = timespec_to_ns(&t_end);
+                    trace_at(TR_CON_END, end_ns, 0);
+                    long step_us = timespec_diff_us(&t_end, &t_set);
+                    if (step_us > phase->period_us)
+                        trace_at(TR_OVERRUN, end_ns, (int32_t)step_us);
+
+                    int late_dump = par->trace_late_us > 0 && late_us > par->trace_late_us &&
+                                    !trace_holdoff && g_tr.auto_dumps < par->trace_dump_max;
+                    trace_holdoff = 0;
+                    if (late_dump) {
+                        ++g_tr.auto_dumps;
+                        trace_dump_bg(TRACE_LATE, &trace_pid);
+                        trace_holdoff = 1;
+                    }
+                    if (g_trace_req) {
+                        g_trace_req = 0;
+                        trace_dump_bg(TRACE_SIGNAL, &trace_pid);
+                        trace_holdoff = 1;
+                    }
+                } else if (g_trace_req) {
+                    g_trace_req = 0;
+                    printf("SIGUSR1: самописец выключен (trace=0)\n");
+                }
+
+                /* Ранний старт: следующий шаг сразу после измерения,
+                   но не раньше t_set + min_period_us и не позже обычного */
+                if (par->settle_adaptive && par->settle_early &&
+                    settle_us < phase->settle_us) {
+                    clock_gettime(CLOCK_MONOTONIC, &t_now);
+                    long done_us = timespec_diff_us(&t_now, &t_set);
+                    if (done_us < par->min_period_us)
+                        done_us = par->min_period_us;
+                    if (done_us < phase->period_us)
+                        next_step_us = done_us;
+                }
 
-                ++idx;
                 ++total_microsteps;
-                iter_mV += phase->step_mV;
             }
 
             if (abort_loops || g_stop)
                 break;
 
-            wait_with_pause(&t_set, phase->pause_ms);
+            /* Конец цикла: усреднённая кривая пишется потомком из снимка
+               таблицы, первый шаг следующего цикла её не ждёт */
+            if (par->aggregate && phase_idx == par->num_phases - 1) {
+                ++agg_cycles;
+                if (par->agg_dump_cycles > 0 && agg_cycles % par->agg_dump_cycles == 0) {
+                    if (writer_busy(&agg_pid, 0)) {
+                        fprintf(stderr, "Усреднённая кривая: предыдущая запись не "
+                                "завершена, цикл %ld пропущен\n", agg_cycles);
+                    } else {
+                        agg_pid = fork_writer();
+                        if (agg_pid == 0)
+                            _exit(agg_dump(avg_fname, par, seqs, agg_cycles) == 0 ? 0 : 1);
+                        if (agg_pid < 0)
+                            perror("Ошибка fork записи усреднённой кривой");
+                    }
+                }
+            }
+
+            /* Контрольная точка следующей фазы — в паузе после этой; если сброс
+               на носитель не уложился, сетка следующей фазы сдвигается */
+            int last_phase = phase_idx == par->num_phases - 1;
+            if (par->checkpoint_enabled &&
+                !(last_phase && par->repeats > 0 && cycle + 1 >= par->repeats)) {
+                int next = last_phase ? 0 : phase_idx + 1;
+                checkpoint_sync(f, &ck, last_phase ? cycle + 1 : cycle, next,
+                                total_microsteps);
+                struct timespec t_first = t_set, t_ck;
+                timespec_add_ms(&t_first, phase->pause_ms);
+                timespec_add_us(&t_first, next_step_us >= 0 ? next_step_us
+                                                             : par->phases[next].period_us);
+                clock_gettime(CLOCK_MONOTONIC, &t_ck);
+                long shift_us = timespec_diff_us(&t_ck, &t_first);
+                if (shift_us > 0) {
+                    timespec_add_us(&t_set, shift_us);
+                    watchdog_extend((int)((shift_us + 999) / 1000));
+                    trace_now(TR_CHECKPOINT, (int32_t)shift_us);
+                }
+            }
+
+            watchdog_extend(phase->pause_ms);
+            if (phase->pause_ms > 0) {
+                trace_now(TR_PAUSE_BEGIN, phase->pause_ms);
+                wait_with_pause(&t_set, phase->pause_ms);
+                trace_now(TR_PAUSE_END, 0);
+            }
         }
 
         if (abort_loops || g_stop)
             break;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &hw->t_last_end);
+    console_end(&con);
+    if (g_met)
+        met_set(&g_met->running, 0);
     printf("\nЗавершение. Микрошагов всего: %ld\n", total_microsteps);
+    if (con.dropped_total > 0)
+        printf("Консоль: не выведено строк (stdout занят) %ld\n", con.dropped_total);
+
+    if (log_thin) {
+        /* пропуски после последней строки (остановка посреди фазы) */
+        if (skipped > 0)
+            log_comment(f, "#skipped;%ld\n", skipped);
+        printf("Прореживание лога: записано строк %ld, пропущено %ld\n",
+               rows_written, skipped_total);
+    }
+
+    if (f_lockin)
+        fclose(f_lockin);
+
+    /* итоговая запись — после фоновой, иначе rename может её обогнать */
+    writer_busy(&agg_pid, 1);
+    if (par->aggregate && agg_dump(avg_fname, par, seqs, agg_cycles) == 0)
+        printf("Усреднённая кривая (%ld циклов): %s\n", agg_cycles, avg_fname);
+
+    /* Между прогонами сторож не ждёт шагов, таймер модуля снят */
+    if (par->wdt_enabled) {
+        watchdog_suspend();
+        if (par->wdt_module_timeout > 0)
+            SetWDTTimeout(fd_io, 0);
+        g_wdt_next_feed_ns = 0;
+    }
+
+    /* Прогон завершён полностью — контрольная точка больше не нужна */
+    if (par->checkpoint_enabled && !g_stop && !abort_loops)
+        unlink(ITER_CHECKPOINT_FILE);
+    if (par->pid_enabled && loop_stats.n > 0) {
+        printf("Тайминг контура: опоздание среднее %.1f / макс %ld мкс, "
+               "запись AO среднее %.1f / макс %ld мкс\n",
+               (double)loop_stats.late_sum / loop_stats.n, loop_stats.late_max,
+               (double)loop_stats.write_sum / loop_stats.n, loop_stats.write_max);
+    }
+
+    if (par->sync_do >= 0 && do_n > 0) {
+        printf("DO%d: запись среднее %.1f / макс %ld мкс\n", par->sync_do,
+               (double)do_us_sum / do_n, do_us_max);
+    }
+    if (do_err > 0)
+        printf("DO%d: ошибок записи %ld\n", par->sync_do, do_err);
+
+    if (verify_n > 0) {
+        printf("Проверка AO чтением: %ld раз, расхождений %ld, ошибок чтения %ld\n",
+               verify_n, verify_bad, verify_err);
+    }
+
+    for (int r = 0; r < par->num_rai; ++r) {
+        if (rai[r].errors > 0)
+            printf("rai%d: ошибок/таймаутов чтения %ld\n", r, rai[r].errors);
+    }
+
+    if (g_tr.on) {
+        writer_busy(&trace_pid, 1);
+        trace_now(TR_DUMP_BEGIN, (int32_t)(g_tr.dumps + 1));
+        trace_dump(TRACE_EXIT, ++g_tr.dumps);
+        g_tr.on = 0;
+    }
 
-    modbus_close(ctx);
-    modbus_free(ctx);
-    AdamIO_Close(fd_io);
+    pk_flush();
+    g_pk.active = 0;
+    int64_t stage_size = g_stage ? (int64_t)ftello(f) : 0;
     fclose(f);
+    if (g_stage) {
+        long waits = g_stage_waits;
+        int64_t total = g_stage_base + stage_size;
+        if (stage_finish(stage_path, stage_size) == 0)
+            printf("Лог перенесён из ОЗУ: %s (%" PRId64 " байт)\n", fname, total);
+        if (waits > 0)
+            printf("Лог в ОЗУ: цикл ждал переноса %ld раз\n", waits);
+    } else {
+        printf("Лог: %s\n", fname);
+    }
+    release_phase_seqs(seqs, par->num_phases);
+
+    return abort_loops ? -1 : 0;
+}
+
+/*
+ * Режим демона: аппаратура открыта один раз, задания берутся из
+ * каталога очереди. Задание — файл <имя>.job со строками
+ *   params=/путь/к/параметрам.txt
+ *   output=/путь/к/логу.csv      (необязательно)
+ * Задания выполняются по порядку имён; файл переименовывается
+ * в .run на время прогона, затем в .done или .failed.
+ */
+static int job_filter(const struct dirent *d)
+{
+    size_t n = strlen(d->d_name);
+    return n > 4 && strcmp(d->d_name + n - 4, ".job") == 0;
+}
+
+static int read_job_file(const char *path, char *params, size_t params_size,
+                         char *output, size_t output_size)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    params[0] = '\0';
+    output[0] = '\0';
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        strtrim(line);
+        char *eq = strchr(line, '=');
+        if (line[0] == '#' || !eq)
+            continue;
+        *eq = '\0';
+        char *key = line;
+        char *val = eq + 1;
+        strtrim(key); strtrim(val);
+        if (strcmp(key, "params") == 0)
+            snprintf(params, params_size, "%s", val);
+        else if (strcmp(key, "output") == 0)
+            snprintf(output, output_size, "%s", val);
+    }
+    fclose(fp);
+    return params[0] != '\0' ? 0 : -1;
+}
+
+/* Модули, сторож, режим АЦП и каталог очереди — от демона,
+   задание их не меняет */
+static void adopt_hw_params(IterParams *job, const IterParams *hwp)
+{
+    memcpy(job->devices, hwp->devices, sizeof(job->devices));
+    job->num_devices = hwp->num_devices;
+    memcpy(job->rai, hwp->rai, sizeof(job->rai));
+    job->num_rai = hwp->num_rai;
+    job->wdt_enabled        = hwp->wdt_enabled;
+    job->wdt_timeout_ms     = hwp->wdt_timeout_ms;
+    job->wdt_late_us        = hwp->wdt_late_us;
+    job->wdt_safe_code      = hwp->wdt_safe_code;
+    job->wdt_module_timeout = hwp->wdt_module_timeout;
+    job->wdt_feed_ms        = hwp->wdt_feed_ms;
+    job->ai_integration_mode = hwp->ai_integration_mode;
+    job->ai_filter_mask      = hwp->ai_filter_mask;
+    job->ai_filter_percent   = hwp->ai_filter_percent;
+}
+
+static void finish_job(const char *spool, const char *base, const char *suffix)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    snprintf(from, sizeof(from), "%s/%s.run", spool, base);
+    snprintf(to, sizeof(to), "%s/%s.%s", spool, base, suffix);
+    rename(from, to);
+}
+
+static int run_daemon(IterParams *hwp, Hardware *hw)
+{
+    const char *spool = hwp->daemon_spool;
+    printf("Демон: очередь %s, пауза между прогонами %ld мс\n",
+           spool, hwp->daemon_gap_ms);
+    fflush(stdout);
+
+    int have_prev = 0;
+    while (!g_stop) {
+        struct dirent **list = NULL;
+        int n = scandir(spool, &list, job_filter, alphasort);
+        if (n < 0) {
+            perror("Ошибка чтения каталога очереди");
+            return -1;
+        }
+        if (n == 0) {
+            free(list);
+            struct timespec t_poll;
+            clock_gettime(CLOCK_MONOTONIC, &t_poll);
+            timespec_add_ms(&t_poll, (int)hwp->daemon_poll_ms);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_poll, NULL);
+            continue;
+        }
+
+        /* одно задание за проход: очередь перечитывается после каждого */
+        char base[256], job_path[PATH_MAX], run_path[PATH_MAX];
+        snprintf(base, sizeof(base), "%.*s",
+                 (int)strlen(list[0]->d_name) - 4, list[0]->d_name);
+        for (int i = 0; i < n; ++i)
+            free(list[i]);
+        free(list);
+
+        snprintf(job_path, sizeof(job_path), "%s/%s.job", spool, base);
+        snprintf(run_path, sizeof(run_path), "%s/%s.run", spool, base);
+        if (rename(job_path, run_path) != 0) {
+            perror(job_path);
+            continue;
+        }
+
+        char params_path[PATH_MAX], output[PATH_MAX];
+        /* ключи оборудования подставляются до проверки: она их учитывает */
+        static IterParams job;
+        int ok = read_job_file(run_path, params_path, sizeof(params_path),
+                               output, sizeof(output)) == 0 &&
+                 load_iter_params(params_path, &job) == 0;
+        if (ok) {
+            adopt_hw_params(&job, hwp);
+            job.checkpoint_enabled = 0;
+            ok = validate_iter_params(&job) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Демон: задание %s отклонено\n", base);
+            finish_job(spool, base, "failed");
+            continue;
+        }
+
+        /* гарантированная пауза от последнего шага предыдущего прогона */
+        struct timespec not_before = hw->t_last_end;
+        timespec_add_ms(&not_before, (int)hwp->daemon_gap_ms);
+
+        printf("\n=== Задание %s: %s ===\n", base, params_path);
+        int rc = run_job(hw, &job, params_path, output[0] ? output : NULL, 0,
+                         have_prev ? &not_before : NULL);
+        finish_job(spool, base, rc == 0 && !g_stop ? "done" : "failed");
+        have_prev = 1;
 
+        if (rc != 0 && !g_stop) {
+            printf("Демон: переподключение модулей после неудачного задания\n");
+            if (hw_reconnect(hwp, hw) != 0) {
+                fprintf(stderr, "Демон: модули недоступны, остановка\n");
+                return -1;
+            }
+        }
+    }
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    /* редкие сообщения во время прогона — сразу, построчно;
+       строки состояния идут мимо stdio (console_tick) */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int resume = 0, daemon_mode = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--resume") == 0) {
+            resume = 1;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = 1;
+        } else {
+            fprintf(stderr, "Использование: %s [--resume | --daemon]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (resume && daemon_mode) {
+        fprintf(stderr, "--resume и --daemon несовместимы\n");
+        return -1;
+    }
+
+    static IterParams par;
+    if (load_iter_params(ITER_PARAMS_FILE, &par) != 0) {
+        return -1;
+    }
+
+    if (validate_iter_params(&par) != 0) {
+        return -1;
+    }
+
+    static Hardware hw;
+    if (hw_open(&par, &hw) != 0)
+        return -1;
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+
+    int rc;
+    if (daemon_mode)
+        rc = run_daemon(&par, &hw);
+    else
+        rc = run_job(&hw, &par, ITER_PARAMS_FILE, NULL, resume, NULL);
+
+    hw_close(&par, &hw);
+    return rc;
+}
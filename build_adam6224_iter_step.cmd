@@ -6,7 +6,7 @@ cd /d C:\ADAM_BUILD
 echo ===   adam6224_iter_step.c ===
 
 docker run --rm -v "%cd%":/work -w /work debian:11 ^
-  bash -lc "dpkg --add-architecture armhf && apt-get update && apt-get install -y gcc-arm-linux-gnueabihf libmodbus-dev:armhf && arm-linux-gnueabihf-gcc -O2 adam6224_iter_step.c -o adam6224_iter_step_arm -I./includes -L./libs -ladamapi -L/usr/arm-linux-gnueabihf/lib -lmodbus"
+  bash -lc "dpkg --add-architecture armhf && apt-get update && apt-get install -y gcc gcc-arm-linux-gnueabihf libmodbus-dev:armhf && arm-linux-gnueabihf-gcc -O2 adam6224_iter_step.c -o adam6224_iter_step_arm -I./includes -L./libs -ladamapi -L/usr/arm-linux-gnueabihf/lib -lmodbus -lm && arm-linux-gnueabihf-gcc -O2 iter_ai_tune.c -o iter_ai_tune_arm -I./includes -L./libs -ladamapi -L/usr/arm-linux-gnueabihf/lib -lmodbus -lm && gcc -O3 iter_log_analyze.c -o iter_log_analyze -lpthread -lm && gcc -O2 iter_log_unpack.c -o iter_log_unpack && gcc -O2 iter_trace_json.c -o iter_trace_json && gcc -O2 iter_modbus_proxy.c -o iter_modbus_proxy -lpthread -lm"
 
 if errorlevel 1 (
     echo.
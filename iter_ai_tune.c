@@ -0,0 +1,475 @@
+/*
+ * iter_ai_tune.c
+ *
+ * Подбор режима АЦП ADAM-6717 для adam6224_iter_step: компромисс
+ * «скорость — шум». Запускается на ADAM-6717, когда программа шагов
+ * не работает (модуль и AO заняты тестом).
+ *
+ * AO (dev0 из iter_params.txt, по умолчанию ADAM-6224 192.168.2.2)
+ * держится на постоянном коде; для каждого режима интегрирования
+ * (AI_SetIntegrationMode: high speed, user defined с частотой
+ * по AI_ScanAutoFilterRate, 50/60 Гц) и уровня автофильтра
+ * (AI_SetAutoFilterEnabled, без фильтра и с заданными уровнями)
+ * измеряются:
+ * - время чтения 8 каналов так же, как в цикле (AI_GetFloatValue подряд);
+ * - период обновления — среднее время между отсчётами, в которых
+ *   изменился хотя бы один канал (чтение быстрее преобразования
+ *   возвращает прежние значения);
+ * - шум — СКО каждого канала (алгоритм Уэлфорда), мкВ.
+ * Время режима — большее из чтения и обновления. Выбирается самый
+ * быстрый режим, у которого СКО всех проверяемых каналов не выше
+ * порога; ключи ai_integration_mode, ai_filter_channels,
+ * ai_filter_percent записываются в iter_params.txt через временный
+ * файл и rename, остальные строки сохраняются как есть.
+ *
+ * Запуск (на ADAM-6717):
+ *   ./iter_ai_tune_arm -t порог_мкВ [-p iter_params.txt] [-c код_AO]
+ *                      [-m каналы] [-n отсчётов] [-f 5,9] [-s мс] [-d]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <modbus/modbus.h>
+
+#include "adamapi.h"
+
+#define ITER_PARAMS_FILE   "/home/root/iter_params.txt"
+
+#define ADAM6224_IP        "192.168.2.2"
+#define ADAM6224_PORT      502
+#define ADAM6224_SLAVE     1
+#define AO0_REG_ADDR       0
+#define AO_CODE_MAX        4095
+
+#define MAX_FILTER_LEVELS  9
+#define MAX_CONFIGS        (3 * (MAX_FILTER_LEVELS + 1))
+#define WARMUP_READS       5
+#define LINE_LEN           512
+
+typedef struct {
+    int mode;                 /* AI_SetIntegrationMode */
+    int percent;              /* 0 — без фильтра, 1..9 */
+    int ok;                   /* режим установлен и измерен */
+    int scan_rate;            /* AI_ScanAutoFilterRate для user defined, -1 — нет */
+    long n;
+    long errors;
+    double read_us;           /* среднее время чтения 8 каналов */
+    double read_max_us;
+    double update_us;         /* средний период обновления */
+    double std_uV[8];
+    double noise_uV;          /* максимум СКО по проверяемым каналам */
+    double time_us;           /* max(read_us, update_us) */
+} TuneResult;
+
+static const struct {
+    int mode;
+    const char *key;
+} k_modes[] = {
+    { 0xA0, "high_speed" },
+    { 0x80, "user" },
+    { 0x00, "50_60hz" },
+};
+#define NUM_MODES ((int)(sizeof(k_modes) / sizeof(k_modes[0])))
+
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1.0e6 + (double)t.tv_nsec * 1.0e-3;
+}
+
+static void strtrim(char *s)
+{
+    char *p = s;
+    while (*p && isspace((unsigned char)*p)) p++;
+    if (p != s) memmove(s, p, strlen(p) + 1);
+
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1])) {
+        s[--len] = '\0';
+    }
+}
+
+static unsigned parse_channel_mask(const char *val)
+{
+    if (strncmp(val, "0x", 2) == 0 || strncmp(val, "0X", 2) == 0)
+        return (unsigned)strtoul(val, NULL, 16) & 0xFF;
+
+    unsigned mask = 0;
+    const char *p = val;
+    while (*p) {
+        char *endptr = NULL;
+        long ch = strtol(p, &endptr, 10);
+        if (endptr == p)
+            break;
+        if (ch >= 0 && ch < 8)
+            mask |= 1u << ch;
+        p = endptr;
+        while (*p == ',' || *p == ' ')
+            ++p;
+    }
+    return mask;
+}
+
+/* Модуль AO dev0 — те же ключи, что у adam6224_iter_step */
+static void read_dev0(const char *path, char *ip, size_t ip_size,
+                      int *port, int *slave, int *reg)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+    char line[LINE_LEN];
+    while (fgets(line, sizeof(line), fp)) {
+        strtrim(line);
+        char *eq = strchr(line, '=');
+        if (line[0] == '#' || !eq)
+            continue;
+        *eq = '\0';
+        char *key = line, *val = eq + 1;
+        strtrim(key); strtrim(val);
+        if (strcmp(key, "dev0_ip") == 0)
+            snprintf(ip, ip_size, "%s", val);
+        else if (strcmp(key, "dev0_port") == 0)
+            *port = atoi(val);
+        else if (strcmp(key, "dev0_slave") == 0)
+            *slave = atoi(val);
+        else if (strcmp(key, "dev0_reg") == 0)
+            *reg = atoi(val);
+    }
+    fclose(fp);
+}
+
+static int set_ai_mode(int fd, int mode, unsigned mask, int percent, int *scan_rate)
+{
+    *scan_rate = -1;
+    if (AI_SetAutoFilterEnabled(fd, percent > 0 ? (unsigned char)mask : 0, percent) != 0 ||
+        AI_SetIntegrationMode(fd, (unsigned char)mode) != 0)
+        return -1;
+    /* user defined: частоту преобразования подбирает сам модуль */
+    if (mode == 0x80 && AI_ScanAutoFilterRate(fd, scan_rate) != 0)
+        return -1;
+
+    unsigned char got = 0;
+    if (AI_GetIntegrationMode(fd, &got) != 0 || got != (unsigned char)mode)
+        return -1;
+    return 0;
+}
+
+/* n отсчётов 8 каналов подряд, как в цикле шагов */
+static void measure(int fd, long n, unsigned mask, TuneResult *r)
+{
+    float prev[8] = {0}, cur[8];
+    double mean[8] = {0}, m2[8] = {0};
+    long updates = 0;
+    double t_first_upd = 0.0, t_last_upd = 0.0;
+
+    r->n = 0;
+    r->errors = 0;
+    r->read_us = 0.0;
+    r->read_max_us = 0.0;
+
+    for (long k = 0; k < n + WARMUP_READS; ++k) {
+        double t0 = now_us();
+        int err = 0;
+        for (int ch = 0; ch < 8; ++ch) {
+            unsigned char st = 0;
+            if (AI_GetFloatValue(fd, ch, &cur[ch], &st) != 0) {
+                cur[ch] = prev[ch];
+                ++err;
+            }
+        }
+        double t1 = now_us();
+        if (k < WARMUP_READS) {
+            memcpy(prev, cur, sizeof(prev));
+            continue;
+        }
+
+        r->errors += err;
+        double dt = t1 - t0;
+        r->read_us += dt;
+        if (dt > r->read_max_us)
+            r->read_max_us = dt;
+
+        if (memcmp(cur, prev, sizeof(cur)) != 0) {
+            if (updates == 0)
+                t_first_upd = t1;
+            t_last_upd = t1;
+            ++updates;
+        }
+        memcpy(prev, cur, sizeof(prev));
+
+        ++r->n;
+        for (int ch = 0; ch < 8; ++ch) {
+            double x = (double)cur[ch];
+            double d = x - mean[ch];
+            mean[ch] += d / (double)r->n;
+            m2[ch] += d * (x - mean[ch]);
+        }
+    }
+
+    r->read_us /= (double)(r->n > 0 ? r->n : 1);
+    /* обновлений меньше двух — период не меньше всего замера */
+    r->update_us = updates > 1 ? (t_last_upd - t_first_upd) / (double)(updates - 1)
+                               : r->read_us * (double)r->n;
+    r->noise_uV = 0.0;
+    for (int ch = 0; ch < 8; ++ch) {
+        r->std_uV[ch] = r->n > 1 ? sqrt(m2[ch] / (double)(r->n - 1)) * 1.0e6 : 0.0;
+        if ((mask & (1u << ch)) && r->std_uV[ch] > r->noise_uV)
+            r->noise_uV = r->std_uV[ch];
+    }
+    r->time_us = r->read_us > r->update_us ? r->read_us : r->update_us;
+}
+
+static const char *mode_key(int mode)
+{
+    for (int i = 0; i < NUM_MODES; ++i) {
+        if (k_modes[i].mode == mode)
+            return k_modes[i].key;
+    }
+    return "?";
+}
+
+/*
+ * Запись выбранного режима в файл параметров: строки с тремя ключами
+ * заменяются (повторы удаляются), недостающие дописываются в конец.
+ */
+static int write_params(const char *path, const TuneResult *best, unsigned mask,
+                        double limit_uV)
+{
+    static const char *const keys[3] = {
+        "ai_integration_mode", "ai_filter_channels", "ai_filter_percent"
+    };
+    char vals[3][32];
+    snprintf(vals[0], sizeof(vals[0]), "%s", mode_key(best->mode));
+    snprintf(vals[1], sizeof(vals[1]), "0x%02X", best->percent > 0 ? mask : 0u);
+    snprintf(vals[2], sizeof(vals[2]), "%d", best->percent);
+
+    char tmp_path[LINE_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *in = fopen(path, "r");
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        perror(tmp_path);
+        if (in)
+            fclose(in);
+        return -1;
+    }
+
+    int done[3] = { 0, 0, 0 };
+    char line[LINE_LEN];
+    while (in && fgets(line, sizeof(line), in)) {
+        char key[LINE_LEN];
+        snprintf(key, sizeof(key), "%s", line);
+        char *eq = strchr(key, '=');
+        int k = -1;
+        if (eq) {
+            *eq = '\0';
+            strtrim(key);
+            for (int i = 0; i < 3; ++i) {
+                if (strcmp(key, keys[i]) == 0)
+                    k = i;
+            }
+        }
+        if (k < 0) {
+            fputs(line, out);
+        } else if (!done[k]) {
+            fprintf(out, "%s=%s\n", keys[k], vals[k]);
+            done[k] = 1;
+        }
+    }
+    if (in)
+        fclose(in);
+
+    if (!done[0] || !done[1] || !done[2]) {
+        fprintf(out, "\n# Режим АЦП (iter_ai_tune: шум <= %.1f мкВ, время %.0f мкс)\n",
+                limit_uV, best->time_us);
+        for (int i = 0; i < 3; ++i) {
+            if (!done[i])
+                fprintf(out, "%s=%s\n", keys[i], vals[i]);
+        }
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        perror(tmp_path);
+        fclose(out);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(out);
+    if (rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *params_path = ITER_PARAMS_FILE;
+    double limit_uV = -1.0;
+    int ao_code = (AO_CODE_MAX + 1) / 2;
+    unsigned mask = 0xFF;
+    long n = 200;
+    const char *levels = "5,9";
+    long settle_ms = 500;
+    int dry_run = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            limit_uV = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            params_path = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            ao_code = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            mask = parse_channel_mask(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            n = atol(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            levels = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            settle_ms = atol(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0)
+            dry_run = 1;
+        else
+            limit_uV = -1.0, i = argc;
+    }
+    if (limit_uV <= 0.0 || mask == 0 || n < 2 || ao_code < 0 || ao_code > AO_CODE_MAX) {
+        fprintf(stderr,
+                "Использование: %s -t порог_мкВ [-p iter_params.txt] [-c код_AO]\n"
+                "       [-m каналы] [-n отсчётов] [-f уровни_фильтра] [-s мс] [-d]\n"
+                "  -t  допустимое СКО шума, мкВ (по всем каналам -m)\n"
+                "  -c  постоянный код AO на время замера (по умолчанию %d)\n"
+                "  -m  проверяемые каналы, например 0,3,7 или 0x89 (по умолчанию все)\n"
+                "  -n  отсчётов на режим (200); -s — установление после смены режима, мс (500)\n"
+                "  -f  уровни автофильтра 1..9 через запятую (5,9), 0 — без фильтра\n"
+                "  -d  только таблица, файл параметров не менять\n",
+                argv[0], (AO_CODE_MAX + 1) / 2);
+        return 1;
+    }
+
+    int percents[MAX_FILTER_LEVELS + 1];
+    int num_levels = 0;
+    percents[num_levels++] = 0;
+    for (const char *p = levels; *p; ) {
+        char *end = NULL;
+        long v = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        if (v >= 1 && v <= MAX_FILTER_LEVELS && num_levels <= MAX_FILTER_LEVELS)
+            percents[num_levels++] = (int)v;
+        p = end;
+        while (*p == ',' || *p == ' ')
+            ++p;
+    }
+
+    /* AO на постоянный код: шум меряется на неподвижном входе */
+    char ip[64] = ADAM6224_IP;
+    int port = ADAM6224_PORT, slave = ADAM6224_SLAVE, reg = AO0_REG_ADDR;
+    read_dev0(params_path, ip, sizeof(ip), &port, &slave, &reg);
+    modbus_t *ctx = modbus_new_tcp(ip, port);
+    if (!ctx || modbus_set_slave(ctx, slave) != 0 || modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Ошибка подключения к модулю AO %s:%d: %s\n",
+                ip, port, modbus_strerror(errno));
+        if (ctx)
+            modbus_free(ctx);
+        return 1;
+    }
+    if (modbus_write_register(ctx, reg, (uint16_t)ao_code) == -1) {
+        fprintf(stderr, "Ошибка modbus_write_register: %s\n", modbus_strerror(errno));
+        modbus_close(ctx);
+        modbus_free(ctx);
+        return 1;
+    }
+
+    int fd = -1;
+    if (AdamIO_Open(&fd) < 0) {
+        fprintf(stderr, "Ошибка AdamIO_Open\n");
+        modbus_close(ctx);
+        modbus_free(ctx);
+        return 1;
+    }
+
+    unsigned char mode0 = 0xA0, fmask0 = 0;
+    int fpercent0 = 0;
+    AI_GetIntegrationMode(fd, &mode0);
+    AI_GetAutoFilterEnabled(fd, &fmask0, &fpercent0);
+    printf("AO %s:%d рег %d = код %d; каналы 0x%02X, %ld отсчётов на режим, порог %.1f мкВ\n",
+           ip, port, reg, ao_code, mask, n, limit_uV);
+    printf("Текущий режим: integration_mode=0x%02X, фильтр 0x%02X %d%%\n\n",
+           mode0, fmask0, fpercent0 * 10);
+
+    /* заголовок выровнен вручную: ширина %-10s считается в байтах */
+    printf("режим      фильтр     чтение       макс    обновл.      время        шум   ошибки\n");
+    printf("                %%        мкс        мкс        мкс        мкс        мкВ\n");
+
+    TuneResult res[MAX_CONFIGS];
+    int nres = 0, best = -1;
+    for (int m = 0; m < NUM_MODES; ++m) {
+        for (int l = 0; l < num_levels; ++l) {
+            TuneResult *r = &res[nres++];
+            memset(r, 0, sizeof(*r));
+            r->mode = k_modes[m].mode;
+            r->percent = percents[l];
+            if (set_ai_mode(fd, r->mode, mask, r->percent, &r->scan_rate) != 0) {
+                printf("%-10s %6d   режим не установлен\n", k_modes[m].key, r->percent * 10);
+                continue;
+            }
+            usleep((useconds_t)settle_ms * 1000u);
+            measure(fd, n, mask, r);
+            r->ok = r->errors == 0;
+
+            printf("%-10s %6d %10.0f %10.0f %10.0f %10.0f %10.1f %8ld", k_modes[m].key,
+                   r->percent * 10, r->read_us, r->read_max_us, r->update_us,
+                   r->time_us, r->noise_uV, r->errors);
+            if (r->scan_rate >= 0)
+                printf("  (частота %d)", r->scan_rate);
+            printf("\n");
+
+            if (r->ok && r->noise_uV <= limit_uV &&
+                (best < 0 || r->time_us < res[best].time_us))
+                best = nres - 1;
+        }
+    }
+
+    int rc = 0;
+    if (best < 0) {
+        printf("\nНи один режим не даёт шум <= %.1f мкВ; режим модуля восстановлен, "
+               "файл параметров не изменён\n", limit_uV);
+        int scan;
+        set_ai_mode(fd, mode0, fmask0, fpercent0, &scan);
+        rc = 2;
+    } else {
+        const TuneResult *b = &res[best];
+        printf("\nВыбран: %s, фильтр %d%% — время %.0f мкс, шум %.1f мкВ\n",
+               mode_key(b->mode), b->percent * 10, b->time_us, b->noise_uV);
+        printf("СКО по каналам, мкВ:");
+        for (int ch = 0; ch < 8; ++ch)
+            printf(" %.1f", b->std_uV[ch]);
+        printf("\n");
+        int scan;
+        set_ai_mode(fd, b->mode, mask, b->percent, &scan);
+        if (dry_run) {
+            printf("-d: %s не изменён\n", params_path);
+        } else if (write_params(params_path, b, mask, limit_uV) == 0) {
+            printf("Записано в %s: ai_integration_mode=%s ai_filter_channels=0x%02X "
+                   "ai_filter_percent=%d\n", params_path, mode_key(b->mode),
+                   b->percent > 0 ? mask : 0u, b->percent);
+        } else {
+            rc = 1;
+        }
+    }
+
+    AdamIO_Close(fd);
+    modbus_close(ctx);
+    modbus_free(ctx);
+    return rc;
+}
@@ -0,0 +1,605 @@
+/*
+ * iter_log_analyze.c
+ *
+ * Разбор логов iter_8ch_*.csv на ПК (не на ADAM-6717).
+ *
+ * Особенности:
+ * - файл отображается в память (mmap), строки разбираются вручную,
+ *   числа — собственным разборщиком без strtod и копирования;
+ * - файл делится на куски по границам циклов, куски обрабатываются
+ *   в нескольких потоках, результаты выводятся в порядке циклов;
+ * - по каждому (циклу, фазе, каналу): n, среднее, СКО, min, max;
+ * - джиттер времени шага по time_ms (с учётом столбца skipped);
+ * - гистерезис между прямым и обратным проходом по уровням iter_mV
+ *   внутри цикла;
+ * - строки, начинающиеся с '#', пропускаются.
+ *
+ * Запуск:
+ *   ./iter_log_analyze [-j потоков] [-o префикс] iter_8ch_YYYYMMDD_HHMMSS.csv
+ * Результат: <префикс>_stats.csv и <префикс>_hyst.csv.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AI_CH            8
+#define MAX_PHASES       8
+#define MAX_COLUMNS      256
+#define MAX_THREADS      64
+#define LEVEL_MIN_MV     (-5000)              /* диапазон AO ±5 В */
+#define LEVEL_COUNT      10001
+#define CHUNKS_PER_THREAD 4
+
+/* Назначение столбца */
+enum {
+    COL_SKIP = 0,
+    COL_CYCLE,
+    COL_PHASE,
+    COL_TIME_MS,
+    COL_ITER_MV,
+    COL_SKIPPED,
+    COL_AI0                                   /* COL_AI0 + ch */
+};
+
+typedef struct {
+    long n;
+    double shift[AI_CH];                      /* первое значение — сдвиг для суммы квадратов */
+    double sum[AI_CH];
+    double sum2[AI_CH];
+    float min[AI_CH];
+    float max[AI_CH];
+
+    long dt_n;
+    double dt_sum, dt_sum2, dt_min, dt_max;
+    double t_prev;
+    int mV_first, mV_last;
+} PhaseAcc;
+
+typedef struct {
+    long cycle;
+    PhaseAcc ph[MAX_PHASES];
+    long hyst_levels;
+    double hyst_sum[AI_CH];                   /* сумма (прямой − обратный) по уровням */
+    double hyst_max[AI_CH];                   /* максимум |прямой − обратный| */
+} CycleResult;
+
+/* Накопители уровней для гистерезиса — на поток */
+typedef struct {
+    float sum[MAX_PHASES][LEVEL_COUNT][AI_CH];
+    uint32_t cnt[MAX_PHASES][LEVEL_COUNT];
+    int touched[MAX_PHASES][LEVEL_COUNT];
+    int n_touched[MAX_PHASES];
+    double dir_sum[2][LEVEL_COUNT][AI_CH];
+    uint32_t dir_cnt[2][LEVEL_COUNT];
+} LevelScratch;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    CycleResult *res;
+    long n_res;
+    long cap_res;
+    long rows;
+    LevelScratch *lv;
+} Chunk;
+
+static Chunk *g_chunks;
+static int g_n_chunks;
+static int g_next_chunk;                      /* очередь кусков для потоков */
+
+static unsigned char g_role[MAX_COLUMNS];
+static int g_num_cols;
+static int g_has_skipped;
+
+static const double g_pow10[19] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+/* Число вида [-]123.456 (формат %d / %.Nf логов); 'e' в логах не бывает */
+static const char *parse_num(const char *p, const char *end, double *out)
+{
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        ++p;
+    }
+
+    uint64_t m = 0;
+    int frac = 0;
+    while (p < end && (unsigned)(*p - '0') < 10)
+        m = m * 10 + (uint64_t)(*p++ - '0');
+    if (p < end && *p == '.') {
+        ++p;
+        while (p < end && (unsigned)(*p - '0') < 10) {
+            if (frac < 18) {
+                m = m * 10 + (uint64_t)(*p - '0');
+                ++frac;
+            }
+            ++p;
+        }
+    }
+
+    double v = (double)m / g_pow10[frac];
+    *out = neg ? -v : v;
+    return p;
+}
+
+static const char *next_line(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl + 1 : end;
+}
+
+/* Разбор заголовка: роль каждого столбца по имени */
+static int parse_header(const char *p, const char *end)
+{
+    static const char *ai_names[AI_CH] = {
+        "AI0", "AI1", "AI2", "AI3", "AI4", "AI5", "AI6", "AI7"
+    };
+    int have = 0;
+
+    g_num_cols = 0;
+    while (p < end && *p != '\n' && g_num_cols < MAX_COLUMNS) {
+        const char *q = p;
+        while (q < end && *q != ';' && *q != '\n' && *q != '\r')
+            ++q;
+        size_t len = (size_t)(q - p);
+        unsigned char role = COL_SKIP;
+
+#define NAME_IS(s) (len == sizeof(s) - 1 && memcmp(p, s, len) == 0)
+        if (NAME_IS("cycle"))        role = COL_CYCLE;
+        else if (NAME_IS("phase"))   role = COL_PHASE;
+        else if (NAME_IS("time_ms")) role = COL_TIME_MS;
+        else if (NAME_IS("iter_mV")) role = COL_ITER_MV;
+        else if (NAME_IS("skipped")) role = COL_SKIPPED;
+        else {
+            for (int ch = 0; ch < AI_CH; ++ch) {
+                if (len == 3 && memcmp(p, ai_names[ch], 3) == 0)
+                    role = (unsigned char)(COL_AI0 + ch);
+            }
+        }
+#undef NAME_IS
+        if (role != COL_SKIP)
+            have |= 1 << role;
+        if (role == COL_SKIPPED)
+            g_has_skipped = 1;
+        g_role[g_num_cols++] = role;
+
+        while (q < end && *q == '\r')
+            ++q;
+        p = (q < end && *q == ';') ? q + 1 : q;
+    }
+
+    int need = (1 << COL_CYCLE) | (1 << COL_PHASE) | (1 << COL_TIME_MS) |
+               (1 << COL_ITER_MV) | (0xFF << COL_AI0);
+    return (have & need) == need ? 0 : -1;
+}
+
+/* Номер цикла — первый столбец строки данных */
+static long line_cycle(const char *p, const char *end)
+{
+    double v = 0.0;
+    parse_num(p, end, &v);
+    return (long)v;
+}
+
+static void phase_reset(PhaseAcc *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+static void cycle_begin(Chunk *c, long cycle)
+{
+    if (c->n_res == c->cap_res) {
+        c->cap_res = c->cap_res ? c->cap_res * 2 : 64;
+        c->res = realloc(c->res, sizeof(CycleResult) * (size_t)c->cap_res);
+        if (!c->res) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    CycleResult *r = &c->res[c->n_res++];
+    memset(r, 0, sizeof(*r));
+    r->cycle = cycle;
+    for (int i = 0; i < MAX_PHASES; ++i)
+        phase_reset(&r->ph[i]);
+}
+
+/* Конец цикла: уровни прямых и обратных фаз сводятся в гистерезис */
+static void cycle_finish(Chunk *c)
+{
+    if (c->n_res == 0)
+        return;
+    CycleResult *r = &c->res[c->n_res - 1];
+    LevelScratch *lv = c->lv;
+
+    for (int ph = 0; ph < MAX_PHASES; ++ph) {
+        PhaseAcc *a = &r->ph[ph];
+        int dir = -1;
+        if (a->n > 0 && a->mV_last > a->mV_first)
+            dir = 0;
+        else if (a->n > 0 && a->mV_last < a->mV_first)
+            dir = 1;
+
+        for (int k = 0; k < lv->n_touched[ph]; ++k) {
+            int l = lv->touched[ph][k];
+            if (dir >= 0) {
+                for (int ch = 0; ch < AI_CH; ++ch)
+                    lv->dir_sum[dir][l][ch] += lv->sum[ph][l][ch];
+                lv->dir_cnt[dir][l] += lv->cnt[ph][l];
+            }
+        }
+    }
+
+    for (int ph = 0; ph < MAX_PHASES; ++ph) {
+        for (int k = 0; k < lv->n_touched[ph]; ++k) {
+            int l = lv->touched[ph][k];
+            if (lv->dir_cnt[0][l] > 0 && lv->dir_cnt[1][l] > 0) {
+                double inv_up = 1.0 / lv->dir_cnt[0][l];
+                double inv_dn = 1.0 / lv->dir_cnt[1][l];
+                for (int ch = 0; ch < AI_CH; ++ch) {
+                    double h = lv->dir_sum[0][l][ch] * inv_up - lv->dir_sum[1][l][ch] * inv_dn;
+                    r->hyst_sum[ch] += h;
+                    if (fabs(h) > r->hyst_max[ch])
+                        r->hyst_max[ch] = fabs(h);
+                }
+                ++r->hyst_levels;
+            }
+            /* уровень мог встретиться в нескольких фазах — обнуление один раз */
+            memset(lv->dir_sum[0][l], 0, sizeof(lv->dir_sum[0][l]));
+            memset(lv->dir_sum[1][l], 0, sizeof(lv->dir_sum[1][l]));
+            lv->dir_cnt[0][l] = 0;
+            lv->dir_cnt[1][l] = 0;
+            memset(lv->sum[ph][l], 0, sizeof(lv->sum[ph][l]));
+            lv->cnt[ph][l] = 0;
+        }
+        lv->n_touched[ph] = 0;
+    }
+}
+
+static void accumulate(CycleResult *r, LevelScratch *lv, int ph, double t_ms,
+                       int mV, long skipped, const float ai[AI_CH])
+{
+    PhaseAcc *a = &r->ph[ph];
+
+    if (a->n == 0) {
+        for (int ch = 0; ch < AI_CH; ++ch) {
+            a->shift[ch] = ai[ch];
+            a->min[ch] = ai[ch];
+            a->max[ch] = ai[ch];
+        }
+        a->mV_first = mV;
+        a->dt_min = INFINITY;
+        a->dt_max = -INFINITY;
+    } else {
+        double dt = (t_ms - a->t_prev) / (double)(skipped + 1);
+        a->dt_sum  += dt;
+        a->dt_sum2 += dt * dt;
+        if (dt < a->dt_min) a->dt_min = dt;
+        if (dt > a->dt_max) a->dt_max = dt;
+        ++a->dt_n;
+    }
+    a->t_prev = t_ms;
+    a->mV_last = mV;
+    ++a->n;
+
+    /* 8 каналов — один векторизуемый проход */
+    for (int ch = 0; ch < AI_CH; ++ch) {
+        double d = ai[ch] - a->shift[ch];
+        a->sum[ch]  += d;
+        a->sum2[ch] += d * d;
+        a->min[ch] = ai[ch] < a->min[ch] ? ai[ch] : a->min[ch];
+        a->max[ch] = ai[ch] > a->max[ch] ? ai[ch] : a->max[ch];
+    }
+
+    int l = mV - LEVEL_MIN_MV;
+    if (l >= 0 && l < LEVEL_COUNT) {
+        if (lv->cnt[ph][l] == 0)
+            lv->touched[ph][lv->n_touched[ph]++] = l;
+        ++lv->cnt[ph][l];
+        for (int ch = 0; ch < AI_CH; ++ch)
+            lv->sum[ph][l][ch] += ai[ch];
+    }
+}
+
+static void process_chunk(Chunk *c)
+{
+    const char *p = c->begin;
+    const char *end = c->end;
+    long cur_cycle = -1;
+
+    c->lv = calloc(1, sizeof(LevelScratch));
+    if (!c->lv) {
+        perror("calloc");
+        exit(1);
+    }
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol)
+            eol = end;
+        if (*p == '#' || eol == p || *p == '\r') {
+            p = eol + 1;
+            continue;
+        }
+
+        long cycle = 0, skipped = 0;
+        int phase = 0, mV = 0;
+        double t_ms = 0.0;
+        float ai[AI_CH] = { 0 };
+
+        const char *q = p;
+        for (int col = 0; col < g_num_cols && q < eol; ++col) {
+            unsigned char role = g_role[col];
+            if (role == COL_SKIP) {
+                const char *sc = memchr(q, ';', (size_t)(eol - q));
+                q = sc ? sc + 1 : eol;
+                continue;
+            }
+            double v;
+            q = parse_num(q, eol, &v);
+            switch (role) {
+            case COL_CYCLE:   cycle = (long)v;  break;
+            case COL_PHASE:   phase = (int)v;   break;
+            case COL_TIME_MS: t_ms = v;         break;
+            case COL_ITER_MV: mV = (int)v;      break;
+            case COL_SKIPPED: skipped = (long)v; break;
+            default:          ai[role - COL_AI0] = (float)v; break;
+            }
+            if (q < eol && *q == ';')
+                ++q;
+        }
+
+        if (cycle != cur_cycle) {
+            cycle_finish(c);
+            cycle_begin(c, cycle);
+            cur_cycle = cycle;
+        }
+        if (phase >= 1 && phase <= MAX_PHASES)
+            accumulate(&c->res[c->n_res - 1], c->lv, phase - 1, t_ms, mV, skipped, ai);
+        ++c->rows;
+        p = eol + 1;
+    }
+    cycle_finish(c);
+
+    free(c->lv);
+    c->lv = NULL;
+}
+
+static void *chunk_worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int k = __atomic_fetch_add(&g_next_chunk, 1, __ATOMIC_RELAXED);
+        if (k >= g_n_chunks)
+            break;
+        process_chunk(&g_chunks[k]);
+    }
+    return NULL;
+}
+
+/*
+ * Граница куска — начало первой строки данных с другим номером цикла
+ * после off; цикл целиком попадает в один кусок.
+ */
+static const char *cycle_boundary(const char *off, const char *end)
+{
+    const char *p = next_line(off, end);
+    while (p < end && *p == '#')
+        p = next_line(p, end);
+    if (p >= end)
+        return end;
+
+    long cycle = line_cycle(p, end);
+    while (p < end) {
+        if (*p != '#' && line_cycle(p, end) != cycle)
+            return p;
+        p = next_line(p, end);
+    }
+    return end;
+}
+
+static void write_results(FILE *fs, FILE *fh, const Chunk *chunks, int n_chunks)
+{
+    fprintf(fs, "cycle;phase;dir;n;dt_mean_ms;dt_std_ms;dt_min_ms;dt_max_ms");
+    for (int ch = 0; ch < AI_CH; ++ch)
+        fprintf(fs, ";AI%d_mean;AI%d_std;AI%d_min;AI%d_max", ch, ch, ch, ch);
+    fputc('\n', fs);
+
+    fprintf(fh, "cycle;levels");
+    for (int ch = 0; ch < AI_CH; ++ch)
+        fprintf(fh, ";AI%d_hyst_mean;AI%d_hyst_max", ch, ch);
+    fputc('\n', fh);
+
+    for (int k = 0; k < n_chunks; ++k) {
+        for (long i = 0; i < chunks[k].n_res; ++i) {
+            const CycleResult *r = &chunks[k].res[i];
+            for (int ph = 0; ph < MAX_PHASES; ++ph) {
+                const PhaseAcc *a = &r->ph[ph];
+                if (a->n == 0)
+                    continue;
+                const char *dir = a->mV_last > a->mV_first ? "up" :
+                                  a->mV_last < a->mV_first ? "down" : "flat";
+                double dt_mean = 0.0, dt_std = 0.0;
+                if (a->dt_n > 0) {
+                    dt_mean = a->dt_sum / a->dt_n;
+                    double var = a->dt_sum2 / a->dt_n - dt_mean * dt_mean;
+                    dt_std = var > 0.0 ? sqrt(var) : 0.0;
+                }
+                fprintf(fs, "%ld;%d;%s;%ld;%.4f;%.4f;%.4f;%.4f",
+                        r->cycle, ph + 1, dir, a->n, dt_mean, dt_std,
+                        a->dt_n > 0 ? a->dt_min : 0.0, a->dt_n > 0 ? a->dt_max : 0.0);
+                for (int ch = 0; ch < AI_CH; ++ch) {
+                    double m = a->sum[ch] / a->n;
+                    double var = a->n > 1 ? (a->sum2[ch] - m * m * a->n) / (a->n - 1) : 0.0;
+                    fprintf(fs, ";%.6f;%.6f;%.6f;%.6f", a->shift[ch] + m,
+                            var > 0.0 ? sqrt(var) : 0.0,
+                            (double)a->min[ch], (double)a->max[ch]);
+                }
+                fputc('\n', fs);
+            }
+
+            fprintf(fh, "%ld;%ld", r->cycle, r->hyst_levels);
+            for (int ch = 0; ch < AI_CH; ++ch) {
+                double mean = r->hyst_levels > 0 ? r->hyst_sum[ch] / r->hyst_levels : 0.0;
+                fprintf(fh, ";%.6f;%.6f", mean, r->hyst_max[ch]);
+            }
+            fputc('\n', fh);
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Использование: %s [-j потоков] [-o префикс] лог.csv\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *prefix = NULL;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            n_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            prefix = argv[++i];
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > MAX_THREADS)
+        n_threads = MAX_THREADS;
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: пустой файл\n", path);
+        close(fd);
+        return 1;
+    }
+    const char *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    /* значения advice не битовые флаги: два отдельных вызова */
+    madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise((void *)data, (size_t)st.st_size, MADV_WILLNEED);
+    const char *end = data + st.st_size;
+
+    /* Заголовок — первая строка, не начинающаяся с '#' */
+    const char *p = data;
+    while (p < end && *p == '#')
+        p = next_line(p, end);
+    if (p >= end || parse_header(p, end) != 0) {
+        fprintf(stderr, "%s: не найден заголовок лога (cycle;phase;...;AI7)\n", path);
+        return 1;
+    }
+    const char *body = next_line(p, end);
+
+    /* Куски по границам циклов: несколько на поток для выравнивания нагрузки */
+    int max_chunks = n_threads * CHUNKS_PER_THREAD;
+    Chunk *chunks = calloc((size_t)max_chunks, sizeof(Chunk));
+    if (!chunks) {
+        perror("calloc");
+        return 1;
+    }
+    int n_chunks = 0;
+    const char *b = body;
+    size_t span = (size_t)(end - body);
+    for (int k = 1; k <= max_chunks && b < end; ++k) {
+        const char *e = k == max_chunks ? end
+                        : cycle_boundary(body + span * (size_t)k / (size_t)max_chunks, end);
+        if (e <= b)
+            continue;
+        chunks[n_chunks].begin = b;
+        chunks[n_chunks].end = e;
+        ++n_chunks;
+        b = e;
+    }
+
+    /* Потоки берут куски из общей очереди; порядок вывода — по кускам */
+    g_chunks = chunks;
+    g_n_chunks = n_chunks;
+    pthread_t th[MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < n_threads && t < n_chunks; ++t) {
+        if (pthread_create(&th[started], NULL, chunk_worker, NULL) == 0)
+            ++started;
+    }
+    chunk_worker(NULL);                       /* основной поток тоже работает */
+    for (int t = 0; t < started; ++t)
+        pthread_join(th[t], NULL);
+
+    char name_stats[512], name_hyst[512];
+    if (prefix) {
+        snprintf(name_stats, sizeof(name_stats), "%s_stats.csv", prefix);
+        snprintf(name_hyst, sizeof(name_hyst), "%s_hyst.csv", prefix);
+    } else {
+        size_t len = strlen(path);
+        if (len > 4 && strcmp(path + len - 4, ".csv") == 0)
+            len -= 4;
+        snprintf(name_stats, sizeof(name_stats), "%.*s_stats.csv", (int)len, path);
+        snprintf(name_hyst, sizeof(name_hyst), "%.*s_hyst.csv", (int)len, path);
+    }
+
+    FILE *fs = fopen(name_stats, "w");
+    FILE *fh = fopen(name_hyst, "w");
+    if (!fs || !fh) {
+        perror("Ошибка создания файла результатов");
+        return 1;
+    }
+    write_results(fs, fh, chunks, n_chunks);
+    fclose(fs);
+    fclose(fh);
+
+    long rows = 0, cycles = 0;
+    for (int k = 0; k < n_chunks; ++k) {
+        rows += chunks[k].rows;
+        cycles += chunks[k].n_res;
+        free(chunks[k].res);
+    }
+    free(chunks);
+    munmap((void *)data, (size_t)st.st_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double sec = (double)(t_end.tv_sec - t_start.tv_sec) +
+                 (double)(t_end.tv_nsec - t_start.tv_nsec) * 1e-9;
+    fprintf(stderr, "%s: строк %ld, циклов %ld, %.1f МБ за %.2f с (%.0f МБ/с, потоков %d)%s\n",
+            path, rows, cycles, (double)st.st_size / 1048576.0, sec,
+            sec > 0.0 ? (double)st.st_size / 1048576.0 / sec : 0.0, n_threads,
+            g_has_skipped ? ", учтён столбец skipped" : "");
+    fprintf(stderr, "Результат: %s, %s\n", name_stats, name_hyst);
+    return 0;
+}
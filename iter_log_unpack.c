@@ -0,0 +1,242 @@
+/*
+ * iter_log_unpack.c
+ *
+ * Распаковка сжатого лога iter_8ch_*.bin (log_format=packed) на ПК
+ * в стандартный CSV — тот же заголовок, формат чисел и строки '#',
+ * что пишет adam6224_iter_step при log_format=csv. AI восстанавливаются
+ * с точностью шага квантования (log_quant_uV).
+ *
+ * Формат — см. комментарий к PackedLog в adam6224_iter_step.c.
+ * Блоки независимы: повреждённый или недописанный последний блок
+ * (обрыв питания) пропускается, предыдущие выводятся полностью.
+ *
+ * Запуск:
+ *   ./iter_log_unpack iter_8ch_YYYYMMDD_HHMMSS.bin [-o out.csv | -o -]
+ * По умолчанию результат — то же имя с расширением .csv.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define PK_MAGIC          "ITERPK1\n"
+#define PK_VERSION        1
+#define PK_TAG_POS        0x01
+#define PK_TAG_GRID       0x02
+#define PK_TAG_TEXT       0x80
+#define PK_MAX_BLOCK      (16u << 20)    /* защита от мусора в длине блока */
+
+#define AO_CODES          4096
+#define AO_MIN_V          (-5.0)
+#define AO_MAX_V          ( 5.0)
+
+static double g_ao_V[AO_CODES];
+static double g_quant_V;
+
+static uint32_t get_u32(const uint8_t *b)
+{
+    return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t *b)
+{
+    return (uint64_t)get_u32(b) | (uint64_t)get_u32(b + 4) << 32;
+}
+
+/* Разбор varint; при выходе за границу блока *ok = 0 */
+static uint64_t get_uvar(const uint8_t **p, const uint8_t *end, int *ok)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (*p < end && shift < 64) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+        shift += 7;
+    }
+    *ok = 0;
+    return 0;
+}
+
+static int64_t get_svar(const uint8_t **p, const uint8_t *end, int *ok)
+{
+    uint64_t u = get_uvar(p, end, ok);
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+/* Один блок: состояние декодера начинается с нуля, как у кодера */
+static long decode_block(FILE *out, const uint8_t *p, const uint8_t *end, int64_t t0_ns)
+{
+    long cycle = 0, idx = -1;
+    int phase = 0;
+    int64_t grid_ns = 0, t_set_ns = 0;
+    int32_t mV = 0, mV_d = 0, code = 0, code_d = 0;
+    int64_t q[8] = { 0 };
+    long rows = 0;
+    int ok = 1;
+
+    while (p < end && ok) {
+        uint8_t tag = *p++;
+        if (tag & PK_TAG_TEXT) {
+            uint64_t n = get_uvar(&p, end, &ok);
+            if (!ok || n > (uint64_t)(end - p))
+                break;
+            fwrite(p, 1, (size_t)n, out);
+            p += n;
+            continue;
+        }
+
+        if (tag & PK_TAG_POS) {
+            cycle = (long)get_uvar(&p, end, &ok);
+            phase = (int)get_uvar(&p, end, &ok);
+            idx   = (long)get_uvar(&p, end, &ok);
+        } else {
+            ++idx;
+        }
+        if (tag & PK_TAG_GRID)
+            grid_ns = (int64_t)get_uvar(&p, end, &ok);
+
+        t_set_ns += grid_ns + get_svar(&p, end, &ok);
+        int64_t ao_done_ns  = t_set_ns + get_svar(&p, end, &ok);
+        int64_t ai_start_ns = t_set_ns + get_svar(&p, end, &ok);
+        int64_t ai_end_ns   = ai_start_ns + get_svar(&p, end, &ok);
+
+        mV_d += (int32_t)get_svar(&p, end, &ok);
+        mV   += mV_d;
+        code_d += (int32_t)get_svar(&p, end, &ok);
+        code   += code_d;
+        for (int ch = 0; ch < 8; ++ch)
+            q[ch] += get_svar(&p, end, &ok);
+        if (!ok)
+            break;
+
+        double iter_V = (double)mV * 0.001;
+        if (iter_V < AO_MIN_V) iter_V = AO_MIN_V;
+        if (iter_V > AO_MAX_V) iter_V = AO_MAX_V;
+        double ao_V = (code >= 0 && code < AO_CODES) ? g_ao_V[code] : 0.0;
+        double t_ms = (double)(ai_start_ns - t0_ns) * 1.0e-6;
+
+        fprintf(out, "%ld;%d;%ld;%.3f;%d;%.6f;%u;%.6f",
+                cycle, phase, idx, t_ms, (int)mV, iter_V, (unsigned int)code, ao_V);
+        for (int ch = 0; ch < 8; ++ch)
+            fprintf(out, ";%.6f", (double)q[ch] * g_quant_V);
+        fprintf(out, ";%" PRId64 ";%" PRId64 ";%" PRId64 ";%" PRId64 "\n",
+                t_set_ns, ao_done_ns, ai_start_ns, ai_end_ns);
+        ++rows;
+    }
+    return ok ? rows : -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else if (!in_path)
+            in_path = argv[i];
+        else
+            in_path = NULL, i = argc;
+    }
+    if (!in_path) {
+        fprintf(stderr, "Использование: %s лог.bin [-o out.csv | -o -]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(in_path, "rb");
+    if (!in) {
+        perror(in_path);
+        return 1;
+    }
+
+    uint8_t hdr[20];
+    if (fread(hdr, 1, 20, in) != 20 || memcmp(hdr, PK_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: не сжатый лог iter_8ch (нет сигнатуры)\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    if (get_u32(hdr + 8) != PK_VERSION || get_u32(hdr + 16) != AO_CODES) {
+        fprintf(stderr, "%s: неподдерживаемая версия формата\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    g_quant_V = (double)get_u32(hdr + 12) * 1.0e-9;
+    if (fread(g_ao_V, sizeof(double), AO_CODES, in) != AO_CODES) {
+        fprintf(stderr, "%s: файл обрезан в заголовке\n", in_path);
+        fclose(in);
+        return 1;
+    }
+
+    uint8_t lb[4];
+    char header[1024];
+    uint32_t hlen = 0;
+    if (fread(lb, 1, 4, in) != 4 || (hlen = get_u32(lb)) >= sizeof(header) ||
+        fread(header, 1, hlen, in) != hlen) {
+        fprintf(stderr, "%s: файл обрезан в заголовке\n", in_path);
+        fclose(in);
+        return 1;
+    }
+
+    char out_buf[512];
+    if (!out_path) {
+        size_t len = strlen(in_path);
+        if (len > 4 && strcmp(in_path + len - 4, ".bin") == 0)
+            len -= 4;
+        snprintf(out_buf, sizeof(out_buf), "%.*s.csv", (int)len, in_path);
+        out_path = out_buf;
+    }
+    FILE *out = strcmp(out_path, "-") == 0 ? stdout : fopen(out_path, "w");
+    if (!out) {
+        perror(out_path);
+        fclose(in);
+        return 1;
+    }
+    fwrite(header, 1, hlen, out);
+
+    uint8_t *payload = NULL;
+    size_t cap = 0;
+    long blocks = 0, rows = 0, bad = 0;
+    uint8_t bh[17];
+    while (fread(bh, 1, sizeof(bh), in) == sizeof(bh)) {
+        uint32_t len = get_u32(bh + 1);
+        if (bh[0] != 'B' || len > PK_MAX_BLOCK) {
+            fprintf(stderr, "%s: повреждённый заголовок блока %ld, разбор остановлен\n",
+                    in_path, blocks);
+            ++bad;
+            break;
+        }
+        if (len > cap) {
+            cap = len;
+            payload = realloc(payload, cap);
+            if (!payload) {
+                perror("realloc");
+                return 1;
+            }
+        }
+        if (fread(payload, 1, len, in) != len) {
+            fprintf(stderr, "%s: последний блок недописан, пропущен\n", in_path);
+            ++bad;
+            break;
+        }
+        long n = decode_block(out, payload, payload + len, (int64_t)get_u64(bh + 9));
+        if (n < 0 || (uint32_t)n != get_u32(bh + 5)) {
+            fprintf(stderr, "%s: блок %ld повреждён\n", in_path, blocks);
+            ++bad;
+        } else {
+            rows += n;
+        }
+        ++blocks;
+    }
+
+    free(payload);
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    fprintf(stderr, "%s: блоков %ld, строк %ld%s -> %s\n", in_path, blocks, rows,
+            bad ? " (есть повреждения)" : "", out_path);
+    return bad ? 2 : 0;
+}
@@ -0,0 +1,559 @@
+/*
+ * iter_modbus_proxy.c
+ *
+ * Прокси Modbus/TCP с внесением отказов — для проверки устойчивости
+ * и тайминга adam6224_iter_step на ПК или стенде (не на ADAM-6717).
+ * Ставится между программой и любым Modbus/TCP-устройством (ADAM-6224
+ * или локальный имитатор): в iter_params.txt указывается адрес прокси
+ * (devN_ip/devN_port, raiN_ip/raiN_port), прокси пересылает кадры
+ * на настоящий адрес.
+ *
+ * Особенности:
+ * - пересылка по кадрам (заголовок MBAP), отказы вносятся в ответы:
+ *   задержка по распределению, редкие «зависания» дольше периода шага,
+ *   потеря ответа, обрыв соединения (RST) — с заданными вероятностями;
+ * - сценарий — файл строк «<время_с> ключ=значение ...»: с указанного
+ *   момента действуют новые параметры (остальные наследуются), ключи
+ *   *_once срабатывают один раз на первом ответе после этого момента;
+ * - каждое действие пишется в журнал CSV с временем UTC, чтобы сопоставить
+ *   его со строками #anchor и шагами лога iter_8ch_*;
+ * - поток на соединение, генератор случайных чисел с заданным зерном —
+ *   прогон воспроизводим; по Ctrl+C печатается сводка.
+ *
+ * Ключи сценария:
+ *   delay=const:МС | uniform:ОТ:ДО | normal:СРЕДНЕЕ:СКО | exp:СРЕДНЕЕ
+ *   stall_p=P stall_ms=МС   drop_p=P   reset_p=P
+ *   stall_once=МС   drop_once=1   reset_once=1
+ *
+ * Запуск:
+ *   ./iter_modbus_proxy -t 192.168.2.2:502 [-l 1502] [-s сценарий.txt]
+ *                       [-f "ключ=значение ..."] [-o журнал.csv] [-r зерно]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_SEGMENTS     256
+#define SEG_TEXT_LEN     200
+#define MBAP_LEN         7
+#define MAX_ADU          260
+
+enum { DELAY_CONST = 0, DELAY_UNIFORM, DELAY_NORMAL, DELAY_EXP };
+
+enum { ACT_PASS = 0, ACT_DELAY, ACT_STALL, ACT_DROP, ACT_RESET, ACT_COUNT };
+
+static const char *const k_act[ACT_COUNT] = { "pass", "delay", "stall", "drop", "reset" };
+
+typedef struct {
+    int kind;
+    double a, b;              /* мс */
+} DelaySpec;
+
+typedef struct {
+    double t_s;
+    DelaySpec delay;
+    double stall_p, stall_ms;
+    double drop_p;
+    double reset_p;
+    int stall_once_ms;        /* одноразовые — забирает первый ответ */
+    int drop_once;
+    int reset_once;
+    char text[SEG_TEXT_LEN];
+} Segment;
+
+typedef struct {
+    int client;
+    int id;
+} Conn;
+
+static Segment g_seg[MAX_SEGMENTS];
+static int g_nseg = 1;
+static char g_target_host[128];
+static char g_target_port[16];
+static uint64_t g_seed = 1;
+static struct timespec g_t0;
+static FILE *g_log;
+static pthread_mutex_t g_log_mx = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t g_stop;
+static long g_act_count[ACT_COUNT];
+static long g_conns;
+
+static void handle_sigint(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+
+static double elapsed_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)(t.tv_sec - g_t0.tv_sec) + (double)(t.tv_nsec - g_t0.tv_nsec) * 1.0e-9;
+}
+
+static int64_t utc_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* xorshift64*: свой генератор на соединение, воспроизводимый по зерну */
+static double rnd_uniform(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return (double)((*s * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double delay_sample(const DelaySpec *d, uint64_t *s)
+{
+    double v = 0.0;
+    switch (d->kind) {
+    case DELAY_UNIFORM:
+        v = d->a + (d->b - d->a) * rnd_uniform(s);
+        break;
+    case DELAY_NORMAL: {
+        double u1 = rnd_uniform(s), u2 = rnd_uniform(s);
+        if (u1 < 1e-300)
+            u1 = 1e-300;
+        v = d->a + d->b * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        break;
+    }
+    case DELAY_EXP:
+        v = -d->a * log(1.0 - rnd_uniform(s));
+        break;
+    default:
+        v = d->a;
+        break;
+    }
+    return v > 0.0 ? v : 0.0;
+}
+
+static int parse_delay(const char *val, DelaySpec *d)
+{
+    char kind[16] = "";
+    double a = 0.0, b = 0.0;
+    int n = sscanf(val, "%15[a-z]:%lf:%lf", kind, &a, &b);
+    if (n >= 2 && strcmp(kind, "const") == 0)
+        d->kind = DELAY_CONST;
+    else if (n == 3 && strcmp(kind, "uniform") == 0 && b >= a)
+        d->kind = DELAY_UNIFORM;
+    else if (n == 3 && strcmp(kind, "normal") == 0)
+        d->kind = DELAY_NORMAL;
+    else if (n >= 2 && strcmp(kind, "exp") == 0)
+        d->kind = DELAY_EXP;
+    else
+        return -1;
+    d->a = a;
+    d->b = b;
+    return 0;
+}
+
+/* «ключ=значение ...» поверх параметров предыдущего отрезка */
+static int parse_segment_keys(Segment *sg, char *text)
+{
+    for (char *tok = strtok(text, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            fprintf(stderr, "Сценарий: ожидается ключ=значение: %s\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        const char *key = tok, *val = eq + 1;
+        if (strcmp(key, "delay") == 0) {
+            if (parse_delay(val, &sg->delay) != 0) {
+                fprintf(stderr, "Сценарий: неверное распределение delay=%s\n", val);
+                return -1;
+            }
+        } else if (strcmp(key, "stall_p") == 0) {
+            sg->stall_p = strtod(val, NULL);
+        } else if (strcmp(key, "stall_ms") == 0) {
+            sg->stall_ms = strtod(val, NULL);
+        } else if (strcmp(key, "drop_p") == 0) {
+            sg->drop_p = strtod(val, NULL);
+        } else if (strcmp(key, "reset_p") == 0) {
+            sg->reset_p = strtod(val, NULL);
+        } else if (strcmp(key, "stall_once") == 0) {
+            sg->stall_once_ms = atoi(val);
+        } else if (strcmp(key, "drop_once") == 0) {
+            sg->drop_once = atoi(val) != 0;
+        } else if (strcmp(key, "reset_once") == 0) {
+            sg->reset_once = atoi(val) != 0;
+        } else {
+            fprintf(stderr, "Сценарий: неизвестный ключ %s\n", key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int add_segment(double t_s, const char *keys)
+{
+    if (g_nseg >= MAX_SEGMENTS) {
+        fprintf(stderr, "Сценарий: больше %d строк\n", MAX_SEGMENTS);
+        return -1;
+    }
+    if (t_s < g_seg[g_nseg - 1].t_s) {
+        fprintf(stderr, "Сценарий: время %.3f меньше предыдущего\n", t_s);
+        return -1;
+    }
+    Segment *sg = &g_seg[g_nseg];
+    *sg = g_seg[g_nseg - 1];
+    sg->t_s = t_s;
+    sg->stall_once_ms = 0;
+    sg->drop_once = 0;
+    sg->reset_once = 0;
+    snprintf(sg->text, sizeof(sg->text), "%s", keys);
+    char buf[SEG_TEXT_LEN];
+    snprintf(buf, sizeof(buf), "%s", keys);
+    if (parse_segment_keys(sg, buf) != 0)
+        return -1;
+    ++g_nseg;
+    return 0;
+}
+
+static int load_schedule(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[SEG_TEXT_LEN + 32];
+    int rc = 0, ln = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        ++ln;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+        char *end;
+        double t_s = strtod(p, &end);
+        if (end == p) {
+            fprintf(stderr, "%s:%d: строка должна начинаться со времени, с\n", path, ln);
+            rc = -1;
+            break;
+        }
+        end[strcspn(end, "\r\n")] = '\0';
+        while (*end == ' ' || *end == '\t')
+            ++end;
+        rc = add_segment(t_s, end);
+    }
+    fclose(f);
+    return rc;
+}
+
+static Segment *current_segment(int *idx)
+{
+    double t = elapsed_s();
+    int i = g_nseg - 1;
+    while (i > 0 && g_seg[i].t_s > t)
+        --i;
+    if (idx)
+        *idx = i;
+    return &g_seg[i];
+}
+
+static void log_action(int conn, const uint8_t *rsp, int act, double delay_ms)
+{
+    unsigned tid = rsp ? (unsigned)(rsp[0] << 8 | rsp[1]) : 0;
+    unsigned func = rsp ? rsp[7] : 0;
+    pthread_mutex_lock(&g_log_mx);
+    ++g_act_count[act];
+    fprintf(g_log, "%.3f;%" PRId64 ";%d;%u;%u;%s;%.3f\n",
+            elapsed_s() * 1000.0, utc_ns(), conn, tid, func, k_act[act], delay_ms);
+    fflush(g_log);
+    pthread_mutex_unlock(&g_log_mx);
+}
+
+static int read_full(int fd, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Кадр Modbus/TCP целиком: MBAP + PDU по полю длины */
+static int read_adu(int fd, uint8_t *buf, size_t *len)
+{
+    if (read_full(fd, buf, MBAP_LEN) != 0)
+        return -1;
+    size_t rest = (size_t)(buf[4] << 8 | buf[5]);
+    if (rest < 2 || MBAP_LEN - 1 + rest > MAX_ADU)
+        return -1;
+    if (read_full(fd, buf + MBAP_LEN, rest - 1) != 0)
+        return -1;
+    *len = MBAP_LEN - 1 + rest;
+    return 0;
+}
+
+static void sleep_ms(double ms)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ms / 1000.0);
+    ts.tv_nsec = (long)((ms - (double)ts.tv_sec * 1000.0) * 1.0e6);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+static int connect_target(void)
+{
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(g_target_host, g_target_port, &hints, &res) != 0 || !res)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/* Обрыв с RST, как при сбросе соединения устройством или сетью */
+static void close_reset(int fd)
+{
+    struct linger lg = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+static void *conn_thread(void *arg)
+{
+    Conn c = *(Conn *)arg;
+    free(arg);
+    uint64_t rng = g_seed * 0x9E3779B97F4A7C15ULL + (uint64_t)c.id;
+    if (rng == 0)
+        rng = 1;
+
+    int up = connect_target();
+    if (up < 0) {
+        fprintf(stderr, "[%d] нет соединения с %s:%s\n", c.id, g_target_host, g_target_port);
+        close(c.client);
+        return NULL;
+    }
+    fprintf(stderr, "[%d] соединение установлено\n", c.id);
+
+    uint8_t req[MAX_ADU], rsp[MAX_ADU];
+    size_t req_len, rsp_len;
+    for (;;) {
+        if (read_adu(c.client, req, &req_len) != 0 ||
+            write_full(up, req, req_len) != 0 ||
+            read_adu(up, rsp, &rsp_len) != 0)
+            break;
+
+        Segment *sg = current_segment(NULL);
+        int act = ACT_PASS;
+        double delay_ms = delay_sample(&sg->delay, &rng);
+        if (delay_ms > 0.0)
+            act = ACT_DELAY;
+
+        /* одноразовые события отрезка — первому ответу */
+        if (__atomic_exchange_n(&sg->reset_once, 0, __ATOMIC_RELAXED) ||
+            rnd_uniform(&rng) < sg->reset_p) {
+            act = ACT_RESET;
+        } else if (__atomic_exchange_n(&sg->drop_once, 0, __ATOMIC_RELAXED) ||
+                   rnd_uniform(&rng) < sg->drop_p) {
+            act = ACT_DROP;
+        } else {
+            int once = __atomic_exchange_n(&sg->stall_once_ms, 0, __ATOMIC_RELAXED);
+            if (once > 0) {
+                delay_ms += once;
+                act = ACT_STALL;
+            } else if (rnd_uniform(&rng) < sg->stall_p) {
+                delay_ms += sg->stall_ms;
+                act = ACT_STALL;
+            }
+        }
+
+        if (act == ACT_RESET) {
+            log_action(c.id, rsp, act, 0.0);
+            close_reset(c.client);
+            close_reset(up);
+            return NULL;
+        }
+        if (act == ACT_DROP) {
+            log_action(c.id, rsp, act, 0.0);
+            continue;
+        }
+        log_action(c.id, rsp, act, delay_ms);
+        if (delay_ms > 0.0)
+            sleep_ms(delay_ms);
+        if (write_full(c.client, rsp, rsp_len) != 0)
+            break;
+    }
+
+    fprintf(stderr, "[%d] соединение закрыто\n", c.id);
+    close(c.client);
+    close(up);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int listen_port = 1502;
+    const char *target = NULL, *schedule = NULL, *inline_keys = NULL;
+    const char *log_path = "-";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            target = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            listen_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            schedule = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            inline_keys = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            log_path = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            g_seed = strtoull(argv[++i], NULL, 0);
+        else
+            target = NULL, i = argc;
+    }
+    const char *colon = target ? strrchr(target, ':') : NULL;
+    if (!target || listen_port <= 0 || listen_port > 65535) {
+        fprintf(stderr,
+                "Использование: %s -t адрес[:порт] [-l порт_прокси] [-s сценарий.txt]\n"
+                "       [-f \"ключ=значение ...\"] [-o журнал.csv] [-r зерно]\n", argv[0]);
+        return 1;
+    }
+    if (colon) {
+        snprintf(g_target_host, sizeof(g_target_host), "%.*s", (int)(colon - target), target);
+        snprintf(g_target_port, sizeof(g_target_port), "%s", colon + 1);
+    } else {
+        snprintf(g_target_host, sizeof(g_target_host), "%s", target);
+        snprintf(g_target_port, sizeof(g_target_port), "502");
+    }
+
+    /* отрезок 0 — без отказов; -f действует с начала, сценарий — по времени */
+    snprintf(g_seg[0].text, sizeof(g_seg[0].text), "без отказов");
+    if (inline_keys && add_segment(0.0, inline_keys) != 0)
+        return 1;
+    if (schedule && load_schedule(schedule) != 0)
+        return 1;
+
+    g_log = strcmp(log_path, "-") == 0 ? stdout : fopen(log_path, "w");
+    if (!g_log) {
+        perror(log_path);
+        return 1;
+    }
+    fprintf(g_log, "t_ms;utc_ns;conn;tid;func;action;delay_ms\n");
+
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons((uint16_t)listen_port);
+    if (ls < 0 || setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(ls, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(ls, 16) != 0) {
+        perror("Ошибка открытия порта прокси");
+        return 1;
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handle_sigint;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    clock_gettime(CLOCK_MONOTONIC, &g_t0);
+    fprintf(stderr, "Прокси :%d -> %s:%s, отрезков сценария %d, зерно %" PRIu64 "\n",
+            listen_port, g_target_host, g_target_port, g_nseg, g_seed);
+
+    int seg_logged = -1;
+    while (!g_stop) {
+        /* смена отрезка сценария — отдельной строкой журнала */
+        int si;
+        current_segment(&si);
+        if (si != seg_logged) {
+            seg_logged = si;
+            pthread_mutex_lock(&g_log_mx);
+            fprintf(g_log, "#segment;%.3f;%" PRId64 ";%d;%s\n",
+                    elapsed_s() * 1000.0, utc_ns(), si, g_seg[si].text);
+            fflush(g_log);
+            pthread_mutex_unlock(&g_log_mx);
+            fprintf(stderr, "Отрезок %d (%.3f с): %s\n", si, g_seg[si].t_s, g_seg[si].text);
+        }
+
+        struct pollfd pfd = { ls, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        int cl = accept(ls, NULL, NULL);
+        if (cl < 0)
+            continue;
+        setsockopt(cl, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn *c = malloc(sizeof(*c));
+        pthread_t th;
+        if (!c) {
+            close(cl);
+            continue;
+        }
+        c->client = cl;
+        c->id = (int)++g_conns;
+        if (pthread_create(&th, NULL, conn_thread, c) != 0) {
+            close(cl);
+            free(c);
+            continue;
+        }
+        pthread_detach(th);
+    }
+
+    /* журнал остаётся заблокированным: потоки соединений больше не пишут */
+    pthread_mutex_lock(&g_log_mx);
+    fprintf(stderr, "\nСоединений %ld; ответов: ", g_conns);
+    for (int a = 0; a < ACT_COUNT; ++a)
+        fprintf(stderr, "%s %ld%s", k_act[a], g_act_count[a], a + 1 < ACT_COUNT ? ", " : "\n");
+    fflush(g_log);
+    return 0;
+}
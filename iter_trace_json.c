@@ -0,0 +1,188 @@
+/*
+ * iter_trace_json.c
+ *
+ * Перевод выгрузки бортового самописца iter_trace_*.bin (trace=1)
+ * в формат Chrome trace-event JSON для просмотра в chrome://tracing
+ * или https://ui.perfetto.dev.
+ *
+ * Формат файла — см. комментарий к TraceEvent в adam6224_iter_step.c.
+ * Интервалы (запись AO, DO, чтение AI, удалённые AI, строка лога, вывод
+ * в консоль, пауза, выгрузка) выводятся парами B/E, остальные события —
+ * отметками; опоздание пробуждения — отдельным графиком late_us.
+ * Время — мкс от t0 прогона. Интервал, начало которого вытеснено из
+ * кольца, пропускается.
+ *
+ * Запуск:
+ *   ./iter_trace_json iter_trace_YYYYMMDD_HHMMSS_001.bin [-o out.json | -o -]
+ * По умолчанию результат — то же имя с расширением .json.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define TRACE_MAGIC       "ITERTRC1"
+#define TRACE_VERSION     1
+#define TRACE_HDR_SIZE    40
+#define TRACE_EV_SIZE     16
+
+/* Типы событий — в том же порядке, что и enum TR_* контроллера */
+typedef struct {
+    const char *name;
+    char ph;            /* 'B', 'E' или 'i' */
+    const char *arg;    /* имя аргумента, NULL — без аргумента */
+} TraceType;
+
+static const TraceType k_types[] = {
+    { NULL,          0,   NULL },
+    { "wake",        'i', "late_us" },
+    { "ao_write",    'B', NULL },
+    { "ao_write",    'E', "code" },
+    { "do_sync",     'B', NULL },
+    { "do_sync",     'E', NULL },
+    { "ai_read",     'B', NULL },
+    { "ai_read",     'E', "errors" },
+    { "rai_collect", 'B', NULL },
+    { "rai_collect", 'E', NULL },
+    { "log_row",     'B', NULL },
+    { "log_row",     'E', "written" },
+    { "console",     'B', NULL },
+    { "console",     'E', NULL },
+    { "pause",       'B', "pause_ms" },
+    { "pause",       'E', NULL },
+    { "trace_dump",  'B', "dump" },
+    { "trace_dump",  'E', "dump" },
+    { "late",        'i', "late_us" },
+    { "overrun",     'i', "step_us" },
+    { "rai_error",   'i', "module" },
+    { "ao_fail",     'i', NULL },
+    { "phase",       'i', "phase" },
+    { "checkpoint",  'i', NULL },
+    { "trigger",     'i', "di" },
+    { "reconnect",   'i', "reconnect" },
+};
+#define TR_TYPES ((uint32_t)(sizeof(k_types) / sizeof(k_types[0])))
+
+static const char *const k_reason[] = { "exit", "SIGUSR1", "late step" };
+
+static uint32_t get_u32(const uint8_t *b)
+{
+    return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t *b)
+{
+    return (uint64_t)get_u32(b) | (uint64_t)get_u32(b + 4) << 32;
+}
+
+int main(int argc, char **argv)
+{
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else if (!in_path)
+            in_path = argv[i];
+        else
+            in_path = NULL, i = argc;
+    }
+    if (!in_path) {
+        fprintf(stderr, "Использование: %s трасса.bin [-o out.json | -o -]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(in_path, "rb");
+    if (!in) {
+        perror(in_path);
+        return 1;
+    }
+
+    uint8_t hdr[TRACE_HDR_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) ||
+        memcmp(hdr, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: не выгрузка самописца (нет сигнатуры)\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    if (get_u32(hdr + 8) != TRACE_VERSION) {
+        fprintf(stderr, "%s: неподдерживаемая версия формата\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    uint32_t reason = get_u32(hdr + 12);
+    uint64_t total = get_u64(hdr + 16);
+    uint32_t n = get_u32(hdr + 24);
+    int64_t t0_ns = (int64_t)get_u64(hdr + 32);
+
+    char out_buf[512];
+    if (!out_path) {
+        size_t len = strlen(in_path);
+        if (len > 4 && strcmp(in_path + len - 4, ".bin") == 0)
+            len -= 4;
+        snprintf(out_buf, sizeof(out_buf), "%.*s.json", (int)len, in_path);
+        out_path = out_buf;
+    }
+    FILE *out = strcmp(out_path, "-") == 0 ? stdout : fopen(out_path, "w");
+    if (!out) {
+        perror(out_path);
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"source\":\"%s\","
+            "\"reason\":\"%s\",\"events_total\":%" PRIu64 "},\"traceEvents\":[\n",
+            in_path, reason < 3 ? k_reason[reason] : "?", total);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+            "\"args\":{\"name\":\"step loop\"}}");
+
+    /* открытые интервалы: E без B (начало вытеснено из кольца) пропускается */
+    int open[TR_TYPES];
+    memset(open, 0, sizeof(open));
+    uint8_t ev[TRACE_EV_SIZE];
+    uint32_t read_n = 0, bad = 0;
+    for (; read_n < n && fread(ev, 1, sizeof(ev), in) == sizeof(ev); ++read_n) {
+        int64_t t_ns = (int64_t)get_u64(ev);
+        uint32_t type = get_u32(ev + 8);
+        int32_t arg = (int32_t)get_u32(ev + 12);
+        if (type == 0 || type >= TR_TYPES) {
+            ++bad;
+            continue;
+        }
+        const TraceType *tt = &k_types[type];
+        if (tt->ph == 'B') {
+            ++open[type + 1];
+        } else if (tt->ph == 'E') {
+            if (open[type] == 0)
+                continue;
+            --open[type];
+        }
+
+        double ts = (double)(t_ns - t0_ns) * 1.0e-3;
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":1,\"ts\":%.3f",
+                tt->name, tt->ph, ts);
+        if (tt->ph == 'i')
+            fputs(",\"s\":\"t\"", out);
+        if (tt->arg)
+            fprintf(out, ",\"args\":{\"%s\":%" PRId32 "}", tt->arg, arg);
+        fputc('}', out);
+
+        if (type == 1)
+            fprintf(out, ",\n{\"name\":\"late_us\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+                    "\"args\":{\"late_us\":%" PRId32 "}}", ts, arg);
+    }
+    fputs("\n]}\n", out);
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    if (read_n < n)
+        fprintf(stderr, "%s: файл обрезан, прочитано %u из %u событий\n", in_path, read_n, n);
+    if (bad > 0)
+        fprintf(stderr, "%s: неизвестных событий %u\n", in_path, bad);
+    fprintf(stderr, "%s (%s): событий %u из %" PRIu64 " -> %s\n", in_path,
+            reason < 3 ? k_reason[reason] : "?", read_n, total, out_path);
+    return read_n < n || bad ? 2 : 0;
+}